@@ -1,14 +1,45 @@
+#include <chrono>
 #include <fstream>
+#include <numeric>
+#include <random>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/numeric/int128.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_uint64(count_modulus, 0,
+              "If non-zero, report arrangement counts modulo this value.");
+DEFINE_bool(wide_counts, false,
+            "Count arrangements with 128-bit integers, for chains long enough "
+            "to overflow int64_t.");
+DEFINE_int32(legacy_count_limit, 1000,
+             "Also run the memoized and joltage-indexed counters when there "
+             "are at most this many adapters. They recurse per adapter and "
+             "count in int64_t, so they overflow on long chains.");
+DEFINE_int32(radix_sort_threshold, 1 << 16,
+             "Inputs with at least this many adapters are radix sorted.");
+DEFINE_string(steps, "1,2,3",
+              "Comma-separated joltage steps (1-64) an adapter can accept.");
+DEFINE_bool(benchmark, false,
+            "Instead of reading input, time the banded and matrix counters on "
+            "generated adapters, and time stepping against matrix powers "
+            "over single runs to show where they cross over.");
+DEFINE_int32(benchmark_adapters, 10000000,
+             "Number of adapters to generate for --benchmark.");
+DEFINE_int32(benchmark_run_length, 10000,
+             "Average run of consecutive adapters generated for --benchmark.");
+DEFINE_uint64(benchmark_modulus, 1000000007,
+              "Modulus for the --benchmark counts. Counts of long chains "
+              "wrap to 0 mod 2^64, which would make the banded and matrix "
+              "counters agree trivially.");
+
 typedef std::vector<int> Adapters;
 typedef absl::flat_hash_set<int> AdapterSet;
 
@@ -35,7 +66,7 @@ int64_t CountPathsLinear(const Adapters& adapters) {
   return path_counts[1] + path_counts[2] + path_counts[3];
 }
 
-int64_t CountPaths(AdapterSet adapters, int start, int end) {
+int64_t CountPaths(const AdapterSet& adapters, int start, int end) {
   if (start == end) {
     return 1;
   }
@@ -53,11 +84,358 @@ int64_t CountPaths(AdapterSet adapters, int start, int end) {
   return total;
 }
 
+// Counts arrangements walking forwards through the sorted |adapters|. Since
+// adapters are distinct and can only be reached from at most 3 jolts below,
+// only the counts for the last 3 adapters are kept, in a rolling window, so
+// memory is constant regardless of the number of adapters or their joltages.
+//
+// If |modulus| is non-zero, counts are reduced modulo |modulus| as they're
+// summed.
+template <typename CountT>
+CountT CountPathsRolling(const Adapters& adapters, CountT modulus) {
+  // Slot i holds the joltage and path count of an adapter. Joltages start far
+  // enough below the outlet that empty slots are never in reach.
+  std::array<int, 3> joltages = {-4, -4, 0};
+  std::array<CountT, 3> counts = {0, 0, 1};
+  int next_slot = 0;
+
+  for (int adapter : adapters) {
+    CHECK_GT(adapter, joltages[(next_slot + 2) % 3]) << "Adapters must be "
+                                                     << "sorted and distinct.";
+    CountT total = 0;
+    for (int i = 0; i < 3; ++i) {
+      if (adapter - joltages[i] <= 3) {
+        total += counts[i];
+        if (modulus != 0) total %= modulus;
+      }
+    }
+    joltages[next_slot] = adapter;
+    counts[next_slot] = total;
+    next_slot = (next_slot + 1) % 3;
+  }
+  // The device is always 3 higher than the last adapter, so the answer is the
+  // last adapter's count.
+  return counts[(next_slot + 2) % 3];
+}
+
+// LSD radix sort of non-negative values, a byte at a time. Passes where every
+// value has the same byte are skipped.
+void RadixSort(Adapters& adapters) {
+  Adapters scratch(adapters.size());
+  for (int shift = 0; shift < 32; shift += 8) {
+    std::array<size_t, 257> offsets = {};
+    for (int adapter : adapters) {
+      CHECK_GE(adapter, 0);
+      ++offsets[((adapter >> shift) & 0xff) + 1];
+    }
+    if (std::find(offsets.begin(), offsets.end(), adapters.size()) !=
+        offsets.end()) {
+      continue;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    for (int adapter : adapters) {
+      scratch[offsets[(adapter >> shift) & 0xff]++] = adapter;
+    }
+    adapters.swap(scratch);
+  }
+}
+
+// Allowed joltage steps, as a bitmask: bit (s - 1) is set if an adapter can
+// take an input s jolts lower.
+typedef uint64_t StepSet;
+
+const StepSet kDefaultSteps = 0b111;
+
+StepSet ParseSteps(absl::string_view steps_string) {
+  StepSet steps = 0;
+  for (auto part : absl::StrSplit(steps_string, ",")) {
+    int step;
+    CHECK(absl::SimpleAtoi(part, &step)) << part;
+    CHECK(step >= 1 && step <= 64) << "Step out of range: " << step;
+    steps |= 1ull << (step - 1);
+  }
+  CHECK_NE(steps, 0);
+  return steps;
+}
+
+int MaxStep(StepSet steps) { return 64 - __builtin_clzll(steps); }
+
+uint64_t AddCounts(uint64_t a, uint64_t b, uint64_t modulus) {
+  if (modulus == 0) return a + b;
+  return static_cast<uint64_t>((absl::uint128(a) + b) % modulus);
+}
+
+uint64_t MultiplyCounts(uint64_t a, uint64_t b, uint64_t modulus) {
+  if (modulus == 0) return a * b;
+  return static_cast<uint64_t>((absl::uint128(a) * b) % modulus);
+}
+
+// Counts arrangements for an arbitrary step set. This is the same forward
+// recurrence as CountPathsRolling, count(a) = sum of count(a - s) for each
+// step s, but over a band of joltages: counts live in a ring indexed by
+// joltage, wide enough to cover the largest step, so each adapter costs one
+// load per step. Slots for joltages without an adapter are zeroed as they're
+// passed over.
+//
+// Counts wrap modulo 2^64, or are reduced modulo |modulus| if it's non-zero.
+uint64_t CountPathsBanded(const Adapters& adapters, StepSet steps,
+                          uint64_t modulus) {
+  int window = 1;
+  while (window <= MaxStep(steps)) window *= 2;
+  const int mask = window - 1;
+  std::vector<uint64_t> counts(window, 0);
+  counts[0] = 1;
+
+  int last = 0;
+  for (int adapter : adapters) {
+    CHECK_GT(adapter, last) << "Adapters must be sorted and distinct.";
+    for (int j = last + 1; j < adapter && j <= last + window; ++j) {
+      counts[j & mask] = 0;
+    }
+    uint64_t total = 0;
+    for (StepSet bits = steps; bits != 0; bits &= bits - 1) {
+      int from = adapter - (__builtin_ctzll(bits) + 1);
+      if (from < 0) break;
+      total = AddCounts(total, counts[from & mask], modulus);
+    }
+    counts[adapter & mask] = total;
+    last = adapter;
+  }
+  return counts[last & mask];
+}
+
+// A run of |length| consecutive joltages, all of which have an adapter.
+struct Run {
+  int64_t start;
+  int64_t length;
+};
+
+std::vector<Run> CompressRuns(const Adapters& adapters) {
+  std::vector<Run> runs;
+  for (int adapter : adapters) {
+    if (!runs.empty() && runs.back().start + runs.back().length == adapter) {
+      ++runs.back().length;
+    } else {
+      runs.push_back({adapter, 1});
+    }
+  }
+  return runs;
+}
+
+// Square matrix of counts, row-major.
+class CountMatrix {
+ public:
+  explicit CountMatrix(int size) : size_(size), values_(size * size, 0) {}
+
+  static CountMatrix Identity(int size) {
+    CountMatrix identity(size);
+    for (int i = 0; i < size; ++i) identity.at(i, i) = 1;
+    return identity;
+  }
+
+  int size() const { return size_; }
+  uint64_t& at(int row, int col) { return values_[row * size_ + col]; }
+  uint64_t at(int row, int col) const { return values_[row * size_ + col]; }
+
+  CountMatrix Multiply(const CountMatrix& other, uint64_t modulus) const {
+    CountMatrix result(size_);
+    for (int i = 0; i < size_; ++i) {
+      for (int k = 0; k < size_; ++k) {
+        uint64_t a = at(i, k);
+        if (a == 0) continue;
+        for (int j = 0; j < size_; ++j) {
+          result.at(i, j) = AddCounts(
+              result.at(i, j), MultiplyCounts(a, other.at(k, j), modulus),
+              modulus);
+        }
+      }
+    }
+    return result;
+  }
+
+  std::vector<uint64_t> Apply(const std::vector<uint64_t>& state,
+                              uint64_t modulus) const {
+    std::vector<uint64_t> result(size_, 0);
+    for (int i = 0; i < size_; ++i) {
+      for (int j = 0; j < size_; ++j) {
+        result[i] = AddCounts(result[i],
+                              MultiplyCounts(at(i, j), state[j], modulus),
+                              modulus);
+      }
+    }
+    return result;
+  }
+
+ private:
+  int size_;
+  std::vector<uint64_t> values_;
+};
+
+// How CountPathsMatrix crosses a run: one joltage at a time, with a power of
+// the transition matrix, or whichever the cost model says is cheaper.
+enum class RunCrossing { kCheapest, kStep, kPower };
+
+// Stepping through a run of |length| joltages costs one addition per step in
+// |steps| per joltage. A matrix power costs up to 2 * log2(length) products of
+// size^3 each, so it only pays off once length / log2(length) is well over
+// size^3 / |steps|: around 100 for the default steps, but 100000 or more for
+// a max step of 64.
+bool PowerIsCheaper(StepSet steps, int64_t length) {
+  int64_t size = MaxStep(steps);
+  int64_t log_length = 64 - __builtin_clzll(length);
+  return 2 * size * size * size * log_length <
+         __builtin_popcountll(steps) * length;
+}
+
+// Counts arrangements by treating the adapters as runs of consecutive
+// joltages. The state is the counts of the last MaxStep(steps) joltages, and
+// a single joltage with an adapter is the linear recurrence
+// state' = T * state. Long runs are crossed with T^length by repeated
+// squaring, so the cost depends on the number of runs and the step size, not
+// on the range of joltages. Short runs are stepped through as in
+// CountPathsBanded, with the counts in the same ring indexed by joltage.
+uint64_t CountPathsMatrix(const std::vector<Run>& runs, StepSet steps,
+                          uint64_t modulus,
+                          RunCrossing crossing = RunCrossing::kCheapest) {
+  const int size = MaxStep(steps);
+  int window = 1;
+  while (window <= size) window *= 2;
+  const int64_t mask = window - 1;
+  // The count for joltage j is counts[j & mask], for the last |size|
+  // joltages up to |current|. Slots for negative joltages are never written,
+  // so they read as zero.
+  std::vector<uint64_t> counts(window, 0);
+  counts[0] = 1;
+  int64_t current = 0;
+
+  CountMatrix transition(size);
+  for (int s = 1; s <= size; ++s) {
+    if (steps & (1ull << (s - 1))) transition.at(0, s - 1) = 1;
+  }
+  for (int i = 1; i < size; ++i) transition.at(i, i - 1) = 1;
+
+  for (const Run& run : runs) {
+    CHECK_GT(run.start, current) << "Adapters must be sorted and distinct.";
+    // The joltages with no adapter have zero counts.
+    int64_t gap = run.start - current - 1;
+    if (gap >= size) {
+      return 0;
+    }
+    for (int64_t j = current + 1; j < run.start; ++j) counts[j & mask] = 0;
+    const int64_t end = run.start + run.length - 1;
+    bool power = crossing == RunCrossing::kPower ||
+                 (crossing == RunCrossing::kCheapest &&
+                  PowerIsCheaper(steps, run.length));
+    if (!power) {
+      for (int64_t j = run.start; j <= end; ++j) {
+        uint64_t total = 0;
+        for (StepSet bits = steps; bits != 0; bits &= bits - 1) {
+          total = AddCounts(
+              total, counts[(j - __builtin_ctzll(bits) - 1) & mask], modulus);
+        }
+        counts[j & mask] = total;
+      }
+    } else {
+      // state[i] is the count for joltage (run.start - 1 - i).
+      std::vector<uint64_t> state(size);
+      for (int i = 0; i < size; ++i) {
+        state[i] = counts[(run.start - 1 - i) & mask];
+      }
+      CountMatrix power = CountMatrix::Identity(size);
+      CountMatrix base = transition;
+      for (int64_t n = run.length; n > 0; n >>= 1) {
+        if (n & 1) power = power.Multiply(base, modulus);
+        if (n > 1) base = base.Multiply(base, modulus);
+      }
+      state = power.Apply(state, modulus);
+      for (int i = 0; i < size; ++i) counts[(end - i) & mask] = state[i];
+    }
+    current = end;
+  }
+  return counts[current & mask];
+}
+
+// Generates sorted adapters in runs averaging --benchmark_run_length, with
+// gaps that the step set can cross, and times each counter on them.
+void RunBenchmark(StepSet steps) {
+  std::mt19937 random(2020);
+  std::uniform_int_distribution<int> run_length(
+      1, 2 * FLAGS_benchmark_run_length);
+  std::uniform_int_distribution<int> gap(1, MaxStep(steps));
+
+  Adapters adapters;
+  adapters.reserve(FLAGS_benchmark_adapters);
+  int joltage = 0;
+  while (adapters.size() < FLAGS_benchmark_adapters) {
+    // Land the next run on a reachable joltage.
+    int next;
+    do {
+      next = gap(random);
+    } while ((steps & (1ull << (next - 1))) == 0);
+    joltage += next;
+    for (int i = run_length(random);
+         i > 0 && adapters.size() < FLAGS_benchmark_adapters; --i) {
+      adapters.push_back(joltage++);
+    }
+    --joltage;
+  }
+
+  auto time = [](const char* name, auto func) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t count = func();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    LOG(INFO) << absl::Substitute("$0: $1 ($2 ms)", name, count,
+                                  elapsed.count());
+    return count;
+  };
+  LOG(INFO) << absl::Substitute("Benchmarking $0 adapters, max step $1",
+                                adapters.size(), MaxStep(steps));
+  uint64_t banded = time("banded", [&]() {
+    return CountPathsBanded(adapters, steps, FLAGS_benchmark_modulus);
+  });
+  uint64_t matrix = time("matrix", [&]() {
+    return CountPathsMatrix(CompressRuns(adapters), steps,
+                            FLAGS_benchmark_modulus);
+  });
+  CHECK_EQ(banded, matrix);
+
+  // Cross single runs of doubling length both ways, until powers have won
+  // twice in a row, to show where the cost model should switch.
+  int power_wins = 0;
+  for (int64_t length = 16; length <= (1 << 26) && power_wins < 2;
+       length *= 2) {
+    std::vector<Run> run = {{1, length}};
+    auto time_crossing = [&](RunCrossing crossing, uint64_t* count) {
+      auto start = std::chrono::steady_clock::now();
+      *count = CountPathsMatrix(run, steps, FLAGS_benchmark_modulus, crossing);
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      return elapsed.count();
+    };
+    uint64_t stepped, powered;
+    double step_ms = time_crossing(RunCrossing::kStep, &stepped);
+    double power_ms = time_crossing(RunCrossing::kPower, &powered);
+    CHECK_EQ(stepped, powered);
+    power_wins = power_ms < step_ms ? power_wins + 1 : 0;
+    LOG(INFO) << absl::Substitute(
+        "Run of $0: step $1 ms, power $2 ms, cost model picks $3", length,
+        step_ms, power_ms, PowerIsCheaper(steps, length) ? "power" : "step");
+  }
+}
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
 
+  StepSet steps = ParseSteps(FLAGS_steps);
+  if (FLAGS_benchmark) {
+    RunBenchmark(steps);
+    return 0;
+  }
+
   std::ifstream file(argv[1]);
   CHECK(file);
 
@@ -68,27 +446,49 @@ int main(int argc, char** argv) {
     CHECK(absl::SimpleAtoi(line, &number));
     adapters.push_back(number);
   }
-  std::sort(adapters.begin(), adapters.end());
+  if (adapters.size() >= FLAGS_radix_sort_threshold) {
+    RadixSort(adapters);
+  } else {
+    std::sort(adapters.begin(), adapters.end());
+  }
 
-  // For ease of doing diffs[delta] instead of storing ones and threes.
-  std::array<int, 4> diffs = {0, 0, 0, 0};
-  int last_joltage = 0;
-  for (int adapter : adapters) {
-    CHECK(adapter - last_joltage < 4);
-    ++diffs[adapter - last_joltage];
-    last_joltage = adapter;
-  }
-  ++diffs[3];
-
-  // Make sure there were no 0 or 2 gaps.
-  CHECK_EQ(diffs[0], 0);
-  CHECK_EQ(diffs[2], 0);
-
-  LOG(INFO) << "PART 1: " << (diffs[1] * diffs[3]);
-  // Find the permutations.
-  AdapterSet adapter_set(adapters.begin(), adapters.end());
-  LOG(INFO) << "PART 2: "
-            << CountPaths(adapter_set, 0, adapters[adapters.size() - 1]);
-  LOG(INFO) << "PART 2 linear: " << CountPathsLinear(adapters);
+  if (steps == kDefaultSteps) {
+    // For ease of doing diffs[delta] instead of storing ones and threes.
+    std::array<int64_t, 4> diffs = {0, 0, 0, 0};
+    int last_joltage = 0;
+    for (int adapter : adapters) {
+      CHECK(adapter - last_joltage < 4);
+      ++diffs[adapter - last_joltage];
+      last_joltage = adapter;
+    }
+    ++diffs[3];
+
+    // Make sure there were no 0 gaps (duplicate adapters).
+    CHECK_EQ(diffs[0], 0);
+
+    LOG(INFO) << "PART 1: " << (diffs[1] * diffs[3]);
+    // Find the permutations, in constant memory first since it's the only
+    // counter that copes with any length of chain.
+    if (FLAGS_wide_counts) {
+      LOG(INFO) << "PART 2: "
+                << CountPathsRolling<absl::uint128>(adapters,
+                                                    FLAGS_count_modulus);
+    } else {
+      LOG(INFO) << "PART 2: "
+                << CountPathsRolling<uint64_t>(adapters, FLAGS_count_modulus);
+    }
+    if (adapters.size() <= FLAGS_legacy_count_limit) {
+      AdapterSet adapter_set(adapters.begin(), adapters.end());
+      LOG(INFO) << "PART 2 memoized: "
+                << CountPaths(adapter_set, 0, adapters[adapters.size() - 1]);
+      LOG(INFO) << "PART 2 linear: " << CountPathsLinear(adapters);
+    }
+  }
+  // These handle any step set.
+  LOG(INFO) << "PART 2 banded: "
+            << CountPathsBanded(adapters, steps, FLAGS_count_modulus);
+  LOG(INFO) << "PART 2 matrix: "
+            << CountPathsMatrix(CompressRuns(adapters), steps,
+                                FLAGS_count_modulus);
   return 0;
 }
@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <numeric>
+#include <thread>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
@@ -7,155 +11,455 @@
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_int32(threads, std::thread::hardware_concurrency(),
+             "Number of threads to step the seat grid with.");
+DEFINE_string(engine, "table",
+              "How to step the simulation: 'table' evaluates every seat each "
+              "step, 'frontier' only seats next to a change in the previous "
+              "step, and 'bitsliced' runs the adjacent-only rule 64 seats at a "
+              "time on bit planes (the line-of-sight rule uses 'frontier').");
+
 typedef std::vector<std::string> SeatMap;
 
 std::string PrintSeats(const SeatMap& seats) {
   return absl::StrJoin(seats, "\n\t");
 }
 
-struct Location {
-  int row;
-  int col;
-  std::string ToString() const { return absl::Substitute("$0,$1", row, col); }
+// Cell values in a seat map. Edge cells pad the grid on every side while the
+// neighbor table is built so lookups never need bounds checks.
+enum Cell : char {
+  kFloor = '.',
+  kEmpty = 'L',
+  kOccupied = '#',
+  kEdge = ' ',
 };
 
-struct Direction {
-  int row_delta;
-  int col_delta;
-};
+// The simulation state for the seats of a seat map. Floor never changes, so
+// only seats are stored, numbered in row-major order, and each seat's
+// neighbors (adjacent seats, or the first seat seen in each direction) are
+// computed once into a compressed sparse row table. A step is then a gather
+// and count over each seat's neighbor list, the same for both rules.
+//
+// Seat state is double-buffered: each step reads one buffer and writes the
+// other, and the buffers are then swapped, so stepping never copies.
+class SeatGrid {
+ public:
+  SeatGrid(const SeatMap& seats, bool adjacent_only)
+      : height_(seats.size()), width_(seats[0].size()) {
+    BuildNeighbors(seats, adjacent_only);
+    next_ = current_;
+  }
 
-Location Move(Location location, Direction direction) {
-  return {location.row + direction.row_delta,
-          location.col + direction.col_delta};
-}
+  // Runs a step of the simulation across |threads| bands of seats. Returns
+  // true if the state has changed.
+  bool Step(int tolerance, int threads) {
+    const int seat_count = seat_cells_.size();
+    threads = std::max(1, std::min(threads, seat_count));
+    // Each band gets its own flag (on its own cache line) so threads don't
+    // contend on a shared one.
+    struct alignas(64) ChangedFlag {
+      bool changed = false;
+    };
+    std::vector<ChangedFlag> changed(threads);
+    if (threads == 1) {
+      changed[0].changed = StepSeats(tolerance, 0, seat_count);
+    } else {
+      std::vector<std::thread> workers;
+      for (int t = 0; t < threads; ++t) {
+        int begin = int64_t{seat_count} * t / threads;
+        int end = int64_t{seat_count} * (t + 1) / threads;
+        workers.emplace_back([&, t, begin, end]() {
+          changed[t].changed = StepSeats(tolerance, begin, end);
+        });
+      }
+      for (auto& worker : workers) worker.join();
+    }
+    current_.swap(next_);
+    cells_evaluated_ += seat_count;
+    return std::any_of(changed.begin(), changed.end(),
+                       [](const ChangedFlag& flag) { return flag.changed; });
+  }
+
+  // Runs a step of the simulation, evaluating only the seats that are next to
+  // (or are) a seat that changed in the previous step; nothing else can
+  // change. Returns true if the state has changed.
+  bool StepFrontier(int tolerance) {
+    if (!frontier_started_) {
+      frontier_started_ = true;
+      frontier_.resize(seat_cells_.size());
+      std::iota(frontier_.begin(), frontier_.end(), 0);
+      frontier_marks_.assign(seat_cells_.size(), 0);
+    }
+    const uint8_t* occupied = current_.data();
+    changes_.clear();
+    for (uint32_t seat : frontier_) {
+      if (NextState(occupied, tolerance, seat) != occupied[seat]) {
+        changes_.push_back(seat);
+      }
+    }
+    cells_evaluated_ += frontier_.size();
 
-int CountOccupied(SeatMap seats) {
-  int count = 0;
-  for (auto row : seats) {
-    for (auto seat : row) {
-      count += seat == '#' ? 1 : 0;
+    // Changes only depend on the previous state, so apply them in place once
+    // they're all known.
+    ++frontier_epoch_;
+    frontier_.clear();
+    auto add_to_frontier = [&](uint32_t seat) {
+      if (frontier_marks_[seat] == frontier_epoch_) return;
+      frontier_marks_[seat] = frontier_epoch_;
+      frontier_.push_back(seat);
+    };
+    for (uint32_t seat : changes_) {
+      current_[seat] ^= 1;
+      add_to_frontier(seat);
+      for (uint32_t i = neighbor_starts_[seat]; i < neighbor_starts_[seat + 1];
+           ++i) {
+        add_to_frontier(neighbors_[i]);
+      }
     }
+    return !changes_.empty();
   }
-  return count;
-}
 
-void CheckAdjacent(const SeatMap& seats, Location location,
-                   std::function<bool(char)> check_seat_func) {
-  int height = seats.size();
-  int width = seats[0].size();
-
-  // All combinations of +1, 0, -1 and +1, 0, -1 (except for 0,0).
-  for (int row_delta = -1; row_delta <= 1; ++row_delta) {
-    int row = location.row + row_delta;
-    if (row < 0 || row >= height) continue;
-    for (int col_delta = -1; col_delta <= 1; ++col_delta) {
-      if (row_delta == 0 && col_delta == 0) continue;
-      int col = location.col + col_delta;
-      if (col < 0 || col >= width) continue;
-      if (!check_seat_func(seats[row][col])) return;
+  int CountOccupied() const {
+    return std::count(current_.begin(), current_.end(), 1);
+  }
+
+  int64_t cells_evaluated() const { return cells_evaluated_; }
+
+  SeatMap ToSeatMap() const {
+    SeatMap seats(height_, std::string(width_, kFloor));
+    for (int seat = 0; seat < seat_cells_.size(); ++seat) {
+      seats[seat_cells_[seat] / width_][seat_cells_[seat] % width_] =
+          current_[seat] ? kOccupied : kEmpty;
     }
+    return seats;
   }
-}
 
-// Walks in a single direction. Returns true to keep walking.
-bool Walk(const SeatMap& seats, Location location, Direction walk_direction,
-          std::function<bool(char)> func) {
-  int height = seats.size();
-  int width = seats[0].size();
-
-  for (auto pos = Move(location, walk_direction);;
-       pos = Move(pos, walk_direction)) {
-    auto [r, c] = pos;
-    if (r < 0 || c < 0) return true;
-    if (c >= width || r >= height) return true;
-    char seat = seats[r][c];
-    if (seat == '.') continue;
-    return func(seats[r][c]);
-  };
-  return true;
-}
+ private:
+  // Returns the next state (1 if occupied) of |seat|.
+  uint8_t NextState(const uint8_t* occupied, int tolerance,
+                    uint32_t seat) const {
+    int count = 0;
+    for (uint32_t i = neighbor_starts_[seat]; i < neighbor_starts_[seat + 1];
+         ++i) {
+      count += occupied[neighbors_[i]];
+    }
+    // Empty seats with no occupied neighbors get filled; taken seats with
+    // tolerance+ occupied neighbors are cleared.
+    return occupied[seat] ? count < tolerance : count == 0;
+  }
 
-void WalkFirstSeen(const SeatMap& seats, Location location,
-                   std::function<bool(char)> func) {
-  // Do a walk for all combinations of +1, 0, -1 and +1, 0, -1 (except for
-  // 0,0) until we reach a seat (empty or taken).
-  for (int row_delta = -1; row_delta <= 1; ++row_delta) {
-    for (int col_delta = -1; col_delta <= 1; ++col_delta) {
-      if (row_delta == 0 && col_delta == 0) continue;
-      // Stop if Walk/the func says we're done.
-      if (!Walk(seats, location, {row_delta, col_delta}, func)) {
-        return;
+  // Numbers the seats and fills the neighbor table. The padded cell map and
+  // the per-cell lookups only live for the duration of this call, so they're
+  // freed before the first step.
+  void BuildNeighbors(const SeatMap& seats, bool adjacent_only) {
+    // Lay the map out padded with edge cells, numbering the seats.
+    const int stride = width_ + 2;
+    std::vector<char> cells((height_ + 2) * stride, kEdge);
+    std::vector<uint32_t> seat_index(cells.size(), kNoSeat);
+    for (int row = 0; row < height_; ++row) {
+      for (int col = 0; col < width_; ++col) {
+        int cell = (row + 1) * stride + col + 1;
+        cells[cell] = seats[row][col];
+        if (cells[cell] == kFloor) continue;
+        seat_index[cell] = seat_cells_.size();
+        seat_cells_.push_back(row * width_ + col);
+        current_.push_back(cells[cell] == kOccupied);
       }
     }
+
+    // For each of the 8 directions, find the neighbor of every cell in that
+    // direction and pass it to |visit| with the cell's seat. Adjacent
+    // neighbors are just the next cell over. For the first seen, sweep
+    // against the direction so the next cell's answer is already known: it's
+    // either a seat itself or passes on the seat it sees.
+    std::vector<uint32_t> seen(cells.size(), kNoSeat);
+    auto for_each_neighbor = [&](auto visit) {
+      for (int row_delta = -1; row_delta <= 1; ++row_delta) {
+        for (int col_delta = -1; col_delta <= 1; ++col_delta) {
+          if (row_delta == 0 && col_delta == 0) continue;
+          const int offset = row_delta * stride + col_delta;
+          for (int r = 1; r <= height_; ++r) {
+            int row = row_delta > 0 ? height_ + 1 - r : r;
+            for (int c = 1; c <= width_; ++c) {
+              int col = col_delta > 0 ? width_ + 1 - c : c;
+              int cell = row * stride + col;
+              int next = cell + offset;
+              if (seat_index[next] != kNoSeat) {
+                seen[cell] = seat_index[next];
+              } else if (adjacent_only || cells[next] == kEdge) {
+                seen[cell] = kNoSeat;
+              } else {
+                seen[cell] = seen[next];
+              }
+              if (seat_index[cell] != kNoSeat && seen[cell] != kNoSeat) {
+                visit(seat_index[cell], seen[cell]);
+              }
+            }
+          }
+        }
+      }
+    };
+
+    // Count each seat's neighbors into neighbor_starts_[seat + 1] and sum
+    // them into offsets. The fill pass then advances neighbor_starts_[seat]
+    // as its cursor, leaving it at the next seat's start, so shift the
+    // offsets back down by one afterwards.
+    const uint32_t seat_count = seat_cells_.size();
+    neighbor_starts_.assign(seat_count + 1, 0);
+    for_each_neighbor([&](uint32_t seat, uint32_t) {
+      ++neighbor_starts_[seat + 1];
+    });
+    std::partial_sum(neighbor_starts_.begin(), neighbor_starts_.end(),
+                     neighbor_starts_.begin());
+    neighbors_.resize(neighbor_starts_[seat_count]);
+    for_each_neighbor([&](uint32_t seat, uint32_t neighbor) {
+      neighbors_[neighbor_starts_[seat]++] = neighbor;
+    });
+    std::copy_backward(neighbor_starts_.begin(), neighbor_starts_.end() - 1,
+                       neighbor_starts_.end());
+    neighbor_starts_[0] = 0;
   }
-}
 
-std::tuple<char, bool> StepSeat(const SeatMap& seats, bool adjacent_only,
-                                int tolerance, Location location) {
-  char current_seat = seats[location.row][location.col];
-  if (current_seat == '.') return {current_seat, false};
-
-  bool was_empty = current_seat == 'L';
-  int count = 0;
-  std::function<bool(char)> check_func = [&](char c) {
-    if (c == '#') {
-      ++count;
-      // Empty seats with any adjacent don't get filled.
-      if (was_empty) return false;
-      // Taken seats with tolerance+ adjacent are cleared.
-      if (count >= tolerance) return false;
+  // Steps seats [begin, end) from current_ into next_. Returns true if any
+  // seat changed.
+  bool StepSeats(int tolerance, int begin, int end) {
+    const uint8_t* occupied = current_.data();
+    uint8_t* next = next_.data();
+    bool has_changed = false;
+    for (int seat = begin; seat < end; ++seat) {
+      uint8_t new_seat = NextState(occupied, tolerance, seat);
+      has_changed |= new_seat != occupied[seat];
+      next[seat] = new_seat;
     }
-    return true;
-  };
+    return has_changed;
+  }
+
+  int height_;
+  int width_;
+  // Marks a cell with no seat in seat_index, or no neighbor in a direction.
+  static constexpr uint32_t kNoSeat = ~0u;
+
+  // Row-major cell (row * width + col) of each seat.
+  std::vector<uint32_t> seat_cells_;
+  // Seat i's neighbors are neighbors_[neighbor_starts_[i]] up to (but not
+  // including) neighbors_[neighbor_starts_[i + 1]].
+  std::vector<uint32_t> neighbor_starts_;
+  std::vector<uint32_t> neighbors_;
+  // 1 if the seat is occupied.
+  std::vector<uint8_t> current_;
+  std::vector<uint8_t> next_;
+
+  // State for StepFrontier: the seats to evaluate next step, the seats that
+  // changed in the current one, and the epoch each seat was last added to the
+  // frontier in, to dedupe it.
+  bool frontier_started_ = false;
+  std::vector<uint32_t> frontier_;
+  std::vector<uint32_t> changes_;
+  std::vector<uint32_t> frontier_marks_;
+  uint32_t frontier_epoch_ = 0;
 
-  if (adjacent_only) {
-    CheckAdjacent(seats, location, check_func);
+  int64_t cells_evaluated_ = 0;
+};
 
-  } else {
-    WalkFirstSeen(seats, location, check_func);
+// The adjacent-only rule, bit-sliced: each row is stored as 64-bit words with
+// one bit per cell, so one word op steps 64 seats. The 8 neighbor bits of
+// every cell are summed into 4 bit planes (a per-bit binary counter) and the
+// rules are evaluated on those planes. The word loops have no branches and
+// vectorize.
+//
+// Only words in or next to a word that changed in the previous step are
+// evaluated.
+class BitSlicedGrid {
+ public:
+  explicit BitSlicedGrid(const SeatMap& seats)
+      : height_(seats.size()),
+        width_(seats[0].size()),
+        words_((width_ + 63) / 64),
+        // One empty row above and below the map.
+        seats_((height_ + 2) * words_, 0),
+        occupied_(seats_.size(), 0),
+        next_(seats_.size(), 0),
+        dirty_(seats_.size(), 1),
+        next_dirty_(seats_.size(), 0) {
+    for (int row = 0; row < height_; ++row) {
+      for (int col = 0; col < width_; ++col) {
+        uint64_t bit = 1ull << (col % 64);
+        int word = Word(row + 1, col / 64);
+        if (seats[row][col] != kFloor) seats_[word] |= bit;
+        if (seats[row][col] == kOccupied) occupied_[word] |= bit;
+      }
+    }
   }
 
-  if (was_empty && count == 0) {
-    return {'#', true};
-  } else if (!was_empty && count >= tolerance) {
-    return {'L', true};
+  // Runs a step of the simulation. Returns true if the state has changed.
+  bool Step(int tolerance) {
+    CHECK(tolerance >= 1 && tolerance <= 8);
+    bool has_changed = false;
+    std::fill(next_dirty_.begin(), next_dirty_.end(), 0);
+    for (int row = 1; row <= height_; ++row) {
+      for (int w = 0; w < words_; ++w) {
+        int word = Word(row, w);
+        if (!dirty_[word]) {
+          next_[word] = occupied_[word];
+          continue;
+        }
+        cells_evaluated_ += __builtin_popcountll(seats_[word]);
+        uint64_t next = StepWord(tolerance, row, w);
+        next_[word] = next;
+        if (next != occupied_[word]) {
+          has_changed = true;
+          MarkDirty(row, w);
+        }
+      }
+    }
+    occupied_.swap(next_);
+    dirty_.swap(next_dirty_);
+    return has_changed;
+  }
+
+  int CountOccupied() const {
+    int count = 0;
+    for (uint64_t word : occupied_) count += __builtin_popcountll(word);
+    return count;
   }
-  return {current_seat, false};
-}
 
-// Run a step of the simulation. Returns the new seatmap and true if the
-// state has changed.
-std::tuple<SeatMap, bool> Step(const SeatMap& seats, bool adjacent_only,
-                               int tolerance) {
-  SeatMap next = seats;
-  bool has_changed = false;
-
-  for (int row = 0; row < seats.size(); ++row) {
-    for (int col = 0; col < seats[0].size(); ++col) {
-      auto [new_seat, seat_changed] =
-          StepSeat(seats, adjacent_only, tolerance, {row, col});
-      has_changed = has_changed || seat_changed;
-      next[row][col] = new_seat;
+  SeatMap ToSeatMap() const {
+    SeatMap seats(height_, std::string(width_, kFloor));
+    for (int row = 0; row < height_; ++row) {
+      for (int col = 0; col < width_; ++col) {
+        uint64_t bit = 1ull << (col % 64);
+        int word = Word(row + 1, col / 64);
+        if (seats_[word] & bit) {
+          seats[row][col] = (occupied_[word] & bit) ? kOccupied : kEmpty;
+        }
+      }
     }
+    return seats;
   }
-  return {next, has_changed};
-}
 
-std::tuple<int, int> RunSimulation(SeatMap seats, bool adjacent_only,
-                                   int tolerance) {
+  int64_t cells_evaluated() const { return cells_evaluated_; }
+
+ private:
+  int Word(int row, int w) const { return row * words_ + w; }
+
+  // Bits of row |row| shifted so each cell lines up with its left (|shift| 1)
+  // or right (|shift| -1) neighbor, carrying across words.
+  uint64_t Shifted(int row, int w, int shift) const {
+    const uint64_t* words = &occupied_[Word(row, 0)];
+    if (shift > 0) {
+      return (words[w] << 1) | (w > 0 ? words[w - 1] >> 63 : 0);
+    }
+    return (words[w] >> 1) | (w + 1 < words_ ? words[w + 1] << 63 : 0);
+  }
+
+  uint64_t StepWord(int tolerance, int row, int w) const {
+    const std::array<uint64_t, 8> neighbors = {
+        Shifted(row - 1, w, 1), occupied_[Word(row - 1, w)],
+        Shifted(row - 1, w, -1), Shifted(row, w, 1),
+        Shifted(row, w, -1), Shifted(row + 1, w, 1),
+        occupied_[Word(row + 1, w)], Shifted(row + 1, w, -1),
+    };
+    // Ripple-carry each neighbor bit into the count planes.
+    std::array<uint64_t, 4> count = {0, 0, 0, 0};
+    for (uint64_t carry : neighbors) {
+      for (int plane = 0; plane < 3; ++plane) {
+        uint64_t sum = count[plane] ^ carry;
+        carry &= count[plane];
+        count[plane] = sum;
+      }
+      count[3] |= carry;
+    }
+
+    // Compare the count against |tolerance|, most significant plane first.
+    uint64_t greater = 0;
+    uint64_t equal = ~0ull;
+    for (int plane = 3; plane >= 0; --plane) {
+      if (tolerance & (1 << plane)) {
+        equal &= count[plane];
+      } else {
+        greater |= equal & count[plane];
+        equal &= ~count[plane];
+      }
+    }
+    uint64_t at_tolerance = greater | equal;
+    uint64_t none = ~(count[0] | count[1] | count[2] | count[3]);
+
+    // Empty seats with no occupied neighbors get filled; taken seats with
+    // tolerance+ occupied neighbors are cleared.
+    uint64_t occupied = occupied_[Word(row, w)];
+    return seats_[Word(row, w)] &
+           ((~occupied & none) | (occupied & ~at_tolerance));
+  }
+
+  // A change in word |w| of |row| can affect any neighboring word.
+  void MarkDirty(int row, int w) {
+    for (int r = row - 1; r <= row + 1; ++r) {
+      if (r < 1 || r > height_) continue;
+      for (int i = std::max(0, w - 1); i <= std::min(words_ - 1, w + 1); ++i) {
+        next_dirty_[Word(r, i)] = 1;
+      }
+    }
+  }
+
+  int height_;
+  int width_;
+  int words_;
+  // A set bit is a seat (not floor).
+  std::vector<uint64_t> seats_;
+  // A set bit is an occupied seat.
+  std::vector<uint64_t> occupied_;
+  std::vector<uint64_t> next_;
+  // Words to evaluate in this step and the next.
+  std::vector<uint8_t> dirty_;
+  std::vector<uint8_t> next_dirty_;
+  int64_t cells_evaluated_ = 0;
+};
+
+// Steps |grid| until it stops changing, logging throughput counters. Returns
+// the number of steps that changed the state and the final occupied count.
+template <typename GridT, typename StepFunc>
+std::tuple<int, int> RunUntilStable(GridT& grid, StepFunc step) {
+  auto start = std::chrono::steady_clock::now();
   int step_count = 0;
   for (;; ++step_count) {
-    auto [next, has_changed] = Step(seats, adjacent_only, tolerance);
-    seats = next;
-    VLOG(1) << "STEP " << step_count << "\n" << PrintSeats(seats);
+    bool has_changed = step(grid);
+    VLOG(1) << "STEP " << step_count << "\n" << PrintSeats(grid.ToSeatMap());
     if (!has_changed) break;
   }
-  return {step_count, CountOccupied(seats)};
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  LOG(INFO) << absl::Substitute(
+      "$0 steps in $1 s ($2 steps/s), $3 cells evaluated", step_count + 1,
+      elapsed.count(), (step_count + 1) / elapsed.count(),
+      grid.cells_evaluated());
+  return {step_count, grid.CountOccupied()};
+}
+
+std::tuple<int, int> RunSimulation(const SeatMap& seats, bool adjacent_only,
+                                   int tolerance) {
+  // The grids need at least one row to take the width from.
+  if (seats.empty()) return {0, 0};
+  if (FLAGS_engine == "bitsliced" && adjacent_only) {
+    BitSlicedGrid grid(seats);
+    return RunUntilStable(
+        grid, [&](BitSlicedGrid& grid) { return grid.Step(tolerance); });
+  }
+  SeatGrid grid(seats, adjacent_only);
+  if (FLAGS_engine == "frontier" || FLAGS_engine == "bitsliced") {
+    return RunUntilStable(
+        grid, [&](SeatGrid& grid) { return grid.StepFrontier(tolerance); });
+  }
+  CHECK_EQ(FLAGS_engine, "table") << "Unknown engine.";
+  return RunUntilStable(grid, [&](SeatGrid& grid) {
+    return grid.Step(tolerance, FLAGS_threads);
+  });
 }
 
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
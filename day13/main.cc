@@ -1,74 +1,278 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <execution>
 #include <fstream>
+#include <iostream>
 #include <numeric>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_string(queries, "",
+              "If set, instead of solving the puzzle, read departure times "
+              "(one per line) from this file, or stdin if '-', and print the "
+              "next bus and its departure time for each.");
+DEFINE_int32(query_batch_size, 4096, "Number of queries answered per batch.");
+
 bool AllPredsTrue(const std::vector<std::function<bool(int64_t)>>& preds,
                   int64_t number) {
-  // LOG(INFO) << "CHECKING " << number;
   for (const auto& pred : preds) {
     if (!pred(number)) return false;
-    LOG(INFO) << "Pred succeeded.";
   }
   return true;
 }
 
-// From https://rosettacode.org/wiki/Chinese_remainder_theorem#C.2B.2B
-// Solve for x in "(a * x) % b == 1"
-template <typename T>
-T MulInv(T a, T b) {
-  T b0 = b;
-  T x0 = 0;
-  T x1 = 1;
+typedef unsigned __int128 uint128;
+
+std::string Uint128ToString(uint128 value) {
+  std::string digits;
+  do {
+    digits.push_back('0' + static_cast<int>(value % 10));
+    value /= 10;
+  } while (value != 0);
+  return std::string(digits.rbegin(), digits.rend());
+}
 
-  if (b == 1) {
-    return 1;
+// Returns (a * b) % m without overflowing. Operands that fit in 64 bits
+// multiply directly in 128 bits; larger ones fall back to double-and-add.
+uint128 MulMod(uint128 a, uint128 b, uint128 m) {
+  a %= m;
+  b %= m;
+  if ((a >> 64) == 0 && (b >> 64) == 0) return a * b % m;
+  uint128 result = 0;
+  for (; b != 0; b >>= 1) {
+    if (b & 1) result = (result + a) % m;
+    a = (a + a) % m;
   }
+  return result;
+}
 
-  while (a > 1) {
-    T q = a / b;
-    T amb = a % b;
+uint128 Gcd(uint128 a, uint128 b) {
+  while (b != 0) {
+    uint128 t = a % b;
     a = b;
-    b = amb;
-
-    T xqx = x1 - q * x0;
-    x1 = x0;
-    x0 = xqx;
+    b = t;
   }
+  return a;
+}
 
-  if (x1 < 0) {
-    x1 += b0;
+// Solve for x in "(a * x) % m == 1", given gcd(a, m) == 1.
+uint128 ModInverse(uint128 a, uint128 m) {
+  if (m == 1) return 0;
+  // Extended Euclid, tracking only the coefficient of |a|. The coefficients
+  // are bounded by |m|, so they fit in a signed 128-bit integer.
+  __int128 old_r = a % m, r = m;
+  __int128 old_s = 1, s = 0;
+  while (r != 0) {
+    __int128 q = old_r / r;
+    std::tie(old_r, r) = std::make_tuple(r, old_r - q * r);
+    std::tie(old_s, s) = std::make_tuple(s, old_s - q * s);
   }
+  CHECK(old_r == 1) << "Not invertible.";
+  return old_s < 0 ? old_s + m : old_s;
+}
 
-  return x1;
+// x = residue mod modulus.
+struct Congruence {
+  uint128 residue;
+  uint128 modulus;
+};
+
+// Combines two congruences into one that holds exactly when both do, or
+// returns nullopt if there is no such x. The moduli don't need to be coprime
+// (generalized CRT): with g = gcd(n, m), x = a mod n and x = b mod m have a
+// solution iff g divides b - a, and it's unique mod lcm(n, m).
+absl::optional<Congruence> Combine(Congruence x, Congruence y) {
+  auto [a, n] = x;
+  auto [b, m] = y;
+  uint128 g = Gcd(n, m);
+  uint128 diff = (b % m + m - a % m) % m;
+  if (diff % g != 0) return absl::nullopt;
+
+  // Solve n * k = diff mod m, i.e. (n / g) * k = diff / g mod (m / g).
+  uint128 m_g = m / g;
+  uint128 k = MulMod(diff / g, ModInverse((n / g) % m_g, m_g), m_g);
+  uint128 lcm;
+  CHECK(!__builtin_mul_overflow(n / g, m, &lcm) && (lcm >> 127) == 0)
+      << "Combined modulus doesn't fit in 127 bits.";
+  // n * k < n * (m / g) = lcm, so this can't overflow.
+  return Congruence{(a % n + n * k) % lcm, lcm};
+}
+
+// Solves the system of congruences by folding them together pairwise, so
+// intermediate values never exceed the combined modulus (unlike multiplying
+// every modulus up front). Returns nullopt if the system is inconsistent.
+absl::optional<Congruence> SolveCongruences(
+    const std::vector<Congruence>& congruences) {
+  Congruence solution = {0, 1};
+  for (const auto& congruence : congruences) {
+    auto combined = Combine(solution, congruence);
+    if (!combined) return absl::nullopt;
+    solution = *combined;
+  }
+  return solution;
 }
 
-// From https://rosettacode.org/wiki/Chinese_remainder_theorem#C.2B.2B
-// Solve for x given a list of equations of the form:
-// x = a mod n
-template <typename T>
-T ChineseRemainder(std::vector<T> n, std::vector<T> a) {
-  // Multiple all the ns so we can solve mod <product>.
-  T prod = std::reduce(n.begin(), n.end(), 1, [](T a, T b) { return a * b; });
-
-  T sm = 0;
-  for (int i = 0; i < n.size(); i++) {
-    T p = prod / n[i];
-    sm += a[i] * MulInv(p, n[i]) * p;
+// A fixed set of busses, prepared to answer "which bus leaves next after time
+// t?" for many t. Each bus id d gets a precomputed magic number and shifts
+// (Granlund and Montgomery's division by invariant integers), which turn
+// t / d into a high multiply, an add and two shifts, all in 32 bits. That
+// keeps every lane 32 bits wide so the kernel runs four queries per SSE2
+// instruction.
+class Timetable {
+ public:
+  explicit Timetable(const std::vector<int>& busses) {
+    for (int bus : busses) {
+      CHECK_GT(bus, 0);
+      const uint32_t d = bus;
+      // l = ceil(log2(d)), m = floor(2^32 * (2^l - d) / d) + 1.
+      const int l = d == 1 ? 0 : 32 - __builtin_clz(d - 1);
+      const uint64_t m = (uint64_t{1} << 32) * ((uint64_t{1} << l) - d) / d + 1;
+      divisors_.push_back({d, static_cast<uint32_t>(m), std::min(l, 1),
+                           std::max(l - 1, 0)});
+    }
+  }
+
+  struct Departure {
+    uint32_t bus;
+    uint64_t time;
+  };
+
+  // Answers a batch of queries. The loop over queries is the inner one, so
+  // each bus's divisor is loop invariant.
+  void NextDepartures(const std::vector<uint32_t>& times,
+                      std::vector<Departure>* departures) const {
+    const size_t count = times.size();
+    std::vector<uint32_t> best_wait(count, UINT32_MAX);
+    std::vector<uint32_t> best_bus(count, 0);
+    for (const Divisor& divisor : divisors_) {
+      size_t i = 0;
+#ifdef __SSE2__
+      i = NextDepartures4(divisor, times.data(), count, best_wait.data(),
+                          best_bus.data());
+#endif
+      for (; i < count; ++i) {
+        uint32_t t = times[i];
+        uint32_t hi = (uint64_t{divisor.m} * t) >> 32;
+        uint32_t q = (hi + ((t - hi) >> divisor.shift1)) >> divisor.shift2;
+        uint32_t remainder = t - q * divisor.d;
+        // A bus leaving exactly at t means no wait.
+        uint32_t wait = remainder == 0 ? 0 : divisor.d - remainder;
+        if (wait < best_wait[i]) {
+          best_wait[i] = wait;
+          best_bus[i] = divisor.d;
+        }
+      }
+    }
+    departures->resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      (*departures)[i] = {best_bus[i], uint64_t{times[i]} + best_wait[i]};
+    }
+  }
+
+ private:
+  struct Divisor {
+    uint32_t d;
+    uint32_t m;
+    int shift1;
+    int shift2;
+  };
+
+#ifdef __SSE2__
+  // The scalar loop in NextDepartures, four queries at a time. Returns how
+  // many queries it handled (a multiple of 4). SSE2 only has 32x32->64
+  // multiplies of the even lanes, so the odd lanes are shifted down and
+  // multiplied separately.
+  static size_t NextDepartures4(const Divisor& divisor, const uint32_t* times,
+                                size_t count, uint32_t* best_wait,
+                                uint32_t* best_bus) {
+    const __m128i d = _mm_set1_epi32(divisor.d);
+    const __m128i m = _mm_set1_epi32(divisor.m);
+    const __m128i shift1 = _mm_cvtsi32_si128(divisor.shift1);
+    const __m128i shift2 = _mm_cvtsi32_si128(divisor.shift2);
+    const __m128i odd_lanes = _mm_set_epi32(-1, 0, -1, 0);
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+      __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(times + i));
+      // hi = (m * t) >> 32 per lane.
+      __m128i even = _mm_mul_epu32(t, m);
+      __m128i odd = _mm_mul_epu32(_mm_srli_epi64(t, 32), m);
+      __m128i hi = _mm_or_si128(_mm_srli_epi64(even, 32),
+                                _mm_and_si128(odd, odd_lanes));
+      __m128i q = _mm_srl_epi32(
+          _mm_add_epi32(hi, _mm_srl_epi32(_mm_sub_epi32(t, hi), shift1)),
+          shift2);
+      // q * d, keeping the low 32 bits of each product.
+      __m128i qd_even = _mm_mul_epu32(q, d);
+      __m128i qd_odd = _mm_mul_epu32(_mm_srli_epi64(q, 32), d);
+      __m128i qd = _mm_unpacklo_epi32(
+          _mm_shuffle_epi32(qd_even, _MM_SHUFFLE(0, 0, 2, 0)),
+          _mm_shuffle_epi32(qd_odd, _MM_SHUFFLE(0, 0, 2, 0)));
+      __m128i remainder = _mm_sub_epi32(t, qd);
+      __m128i wait = _mm_andnot_si128(_mm_cmpeq_epi32(remainder, zero),
+                                      _mm_sub_epi32(d, remainder));
+
+      __m128i* wait_out = reinterpret_cast<__m128i*>(best_wait + i);
+      __m128i* bus_out = reinterpret_cast<__m128i*>(best_bus + i);
+      __m128i old_wait = _mm_loadu_si128(wait_out);
+      __m128i old_bus = _mm_loadu_si128(bus_out);
+      // Unsigned wait < old_wait, via a signed compare with the sign flipped.
+      __m128i better = _mm_cmpgt_epi32(_mm_xor_si128(old_wait, sign),
+                                       _mm_xor_si128(wait, sign));
+      _mm_storeu_si128(wait_out,
+                       _mm_or_si128(_mm_and_si128(better, wait),
+                                    _mm_andnot_si128(better, old_wait)));
+      _mm_storeu_si128(bus_out,
+                       _mm_or_si128(_mm_and_si128(better, d),
+                                    _mm_andnot_si128(better, old_bus)));
+    }
+    return i;
   }
+#endif
 
-  return sm % prod;
+  std::vector<Divisor> divisors_;
+};
+
+// Answers every query in |in| in batches, writing "time bus departure" lines.
+void AnswerQueries(const Timetable& timetable, std::istream& in) {
+  std::vector<uint32_t> times;
+  std::vector<Timetable::Departure> departures;
+  std::string line;
+  std::string output;
+  auto flush = [&]() {
+    timetable.NextDepartures(times, &departures);
+    output.clear();
+    for (size_t i = 0; i < times.size(); ++i) {
+      absl::StrAppend(&output, times[i], " ", departures[i].bus, " ",
+                      departures[i].time, "\n");
+    }
+    std::cout << output;
+    times.clear();
+  };
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    uint32_t time;
+    CHECK(absl::SimpleAtoi(line, &time)) << "Bad time: " << line;
+    times.push_back(time);
+    if (times.size() == FLAGS_query_batch_size) flush();
+  }
+  if (!times.empty()) flush();
 }
 
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -91,6 +295,18 @@ int main(int argc, char** argv) {
     busses.push_back(bus);
   }
 
+  if (!FLAGS_queries.empty()) {
+    Timetable timetable(busses);
+    if (FLAGS_queries == "-") {
+      AnswerQueries(timetable, std::cin);
+    } else {
+      std::ifstream queries(FLAGS_queries);
+      CHECK(queries) << FLAGS_queries;
+      AnswerQueries(timetable, queries);
+    }
+    return 0;
+  }
+
   // Part 1: find the bus that leaves closest to but not before our departure
   // time.
   int min_distance = INT_MAX;
@@ -108,21 +324,19 @@ int main(int argc, char** argv) {
   // subreddit folks hinted at. This is an obnoxious "gotcha" problem that you
   // can't reasonably solve with brute force (estimates are anywhere from 2-70
   // days, on the subreddit).
-  // I don't actually know the math for this, so I took it from rosettacode.org.
-  // This isn't a "programming" problem, this is a "do you recognize a math
-  // identity" problem.
-  std::vector<int64_t> a;
-  std::vector<int64_t> n;
+  // Bus |i| in the list has to leave at t + i, so t = -i mod bus_id. Busses
+  // don't need to be coprime: repeated or overlapping ids just have to agree.
+  std::vector<Congruence> congruences;
   for (int64_t i = 0; i < bus_strings.size(); ++i) {
     int64_t bus_id;
     if (!absl::SimpleAtoi(bus_strings[i], &bus_id)) continue;
-
-    // Remember that we're looking for next largest, so we're looking for the
-    // coefficient to be bus_id - i.
-    a.push_back(bus_id - i);
-    n.push_back(bus_id);
+    CHECK_GT(bus_id, 0);
+    congruences.push_back({static_cast<uint128>((bus_id - i % bus_id) % bus_id),
+                           static_cast<uint128>(bus_id)});
   }
 
-  LOG(INFO) << "PART 2: " << ChineseRemainder(n, a);
+  auto solution = SolveCongruences(congruences);
+  CHECK(solution) << "No departure time satisfies the schedule.";
+  LOG(INFO) << "PART 2: " << Uint128ToString(solution->residue);
   return 0;
 }
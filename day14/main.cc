@@ -1,48 +1,290 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <chrono>
+#include <cstring>
 #include <execution>
 #include <fstream>
+#include <memory>
 #include <numeric>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/numeric/int128.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
-typedef absl::flat_hash_map<int64_t, int64_t> Memory;
+DEFINE_int32(max_expanded_floating_bits, 20,
+             "Part 2 also expands every floating address into memory when no "
+             "mask has more than this many floating bits.");
+DEFINE_bool(compiled, false,
+            "The input is a compiled program (see --save_compiled), not text.");
+DEFINE_string(save_compiled, "",
+              "If set, write the program in compiled form to this path.");
+DEFINE_string(memory, "hash",
+              "Memory backend for the emulated parts: 'hash', 'paged', or "
+              "'all' to run and time each.");
+
+// Emulated memory backends. Each keeps a running sum of all values as they're
+// written, so the answer doesn't need a final pass over memory.
+
+// Memory as a hash map from address to value.
+class HashMemory {
+ public:
+  void Write(uint64_t address, int64_t value) {
+    auto [it, inserted] = values_.try_emplace(address, value);
+    if (!inserted) {
+      sum_ -= it->second;
+      it->second = value;
+    }
+    sum_ += value;
+  }
+
+  int64_t Sum() const { return sum_; }
+
+ private:
+  absl::flat_hash_map<uint64_t, int64_t> values_;
+  int64_t sum_ = 0;
+};
+
+// Memory as a two-level page table over dense pages of 4K values, like a
+// CPU's. Tables and pages are allocated the first time they're written to.
+// Writes with locality (like the runs of addresses from a floating mask) land
+// on the same page, without any hashing or probing.
+class PagedMemory {
+ public:
+  static constexpr int kPageBits = 12;
+  static constexpr int kTableBits = 12;
+  static constexpr int kDirectoryBits = 36 - kPageBits - kTableBits;
+
+  void Write(uint64_t address, int64_t value) {
+    CHECK_LT(address, uint64_t{1} << 36) << "Address out of range.";
+    auto& table = directory_[address >> (kPageBits + kTableBits)];
+    if (!table) table = std::make_unique<Table>();
+    auto& page = (*table)[(address >> kPageBits) & ((1 << kTableBits) - 1)];
+    if (!page) page = std::make_unique<Page>();
+    int64_t& slot = (*page)[address & ((1 << kPageBits) - 1)];
+    sum_ += value - slot;
+    slot = value;
+  }
+
+  int64_t Sum() const { return sum_; }
+
+ private:
+  // Pages are value-initialized, so unwritten memory reads as 0.
+  typedef std::array<int64_t, 1 << kPageBits> Page;
+  typedef std::array<std::unique_ptr<Page>, 1 << kTableBits> Table;
+  std::array<std::unique_ptr<Table>, 1 << kDirectoryBits> directory_;
+  int64_t sum_ = 0;
+};
+
+constexpr int kMaskBits = 36;
+
+// A mask compiled to bitmasks, and the range of writes in the program that it
+// applies to.
+struct CompiledMask {
+  // Bits that are 1 or X.
+  uint64_t and_mask;
+  // Bits that are 1.
+  uint64_t or_mask;
+  // Bits that are X.
+  uint64_t x_mask;
+  uint64_t first_write;
+  uint64_t write_count;
+};
 
-struct Instruction {
-  std::string mask;
-  std::vector<std::pair<int64_t, int64_t>> writes;
+struct Write {
+  uint64_t address;
+  uint64_t value;
 };
 
-int64_t DoPart1(const std::vector<Instruction>& instructions) {
-  Memory mem;
-
-  for (auto [mask, writes] : instructions) {
-    int64_t and_mask, or_mask;
-    // For the AND portion: convert Xs to 1s (ignore) and read in base 2.
-    CHECK(absl::numbers_internal::safe_strtoi_base(
-        absl::StrReplaceAll(mask, {{"X", "1"}}), &and_mask, 2));
-    // For the OR portion: convert Xs to 0s (ignore) and read in base 2.
-    CHECK(absl::numbers_internal::safe_strtoi_base(
-        absl::StrReplaceAll(mask, {{"X", "0"}}), &or_mask, 2));
-
-    for (auto [address, val] : writes) {
-      val &= and_mask;
-      val |= or_mask;
-      mem[address] = val;
+// Compiles a mask string. The characters are classified 16 at a time with SSE2
+// compares (when available), with the string reversed first so bit i of each
+// compare's movemask is bit i of the value.
+CompiledMask CompileMask(absl::string_view mask) {
+  CHECK_EQ(mask.size(), kMaskBits) << mask;
+  alignas(16) char reversed[48] = {};
+  std::reverse_copy(mask.begin(), mask.end(), reversed);
+
+  uint64_t zeros = 0, ones = 0, xs = 0;
+#ifdef __SSE2__
+  for (int i = 0; i < sizeof(reversed); i += 16) {
+    __m128i chunk =
+        _mm_load_si128(reinterpret_cast<const __m128i*>(reversed + i));
+    auto classify = [&](char c) {
+      return static_cast<uint64_t>(
+                 _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c))))
+             << i;
+    };
+    zeros |= classify('0');
+    ones |= classify('1');
+    xs |= classify('X');
+  }
+#else
+  for (int i = 0; i < kMaskBits; ++i) {
+    zeros |= uint64_t{reversed[i] == '0'} << i;
+    ones |= uint64_t{reversed[i] == '1'} << i;
+    xs |= uint64_t{reversed[i] == 'X'} << i;
+  }
+#endif
+  CHECK_EQ(zeros | ones | xs, (uint64_t{1} << kMaskBits) - 1)
+      << "Bad mask: " << mask;
+  return {ones | xs, ones, xs, 0, 0};
+}
+
+// A whole program in compiled form: every mask, and every write packed into
+// one flat array in program order. A compiled program can be saved to disk and
+// mapped back in, with no parsing.
+class Program {
+ public:
+  Program() = default;
+
+  // masks_ and writes_ point into the object's own storage, so copies would
+  // dangle. Moves take the storage along and re-point the spans at it.
+  Program(const Program&) = delete;
+  Program& operator=(const Program&) = delete;
+  Program(Program&& other) { *this = std::move(other); }
+  Program& operator=(Program&& other) {
+    if (this == &other) return *this;
+    owned_masks_ = std::move(other.owned_masks_);
+    owned_writes_ = std::move(other.owned_writes_);
+    mapping_ = std::move(other.mapping_);
+    if (mapping_) {
+      masks_ = other.masks_;
+      writes_ = other.writes_;
+    } else {
+      masks_ = owned_masks_;
+      writes_ = owned_writes_;
     }
+    other.masks_ = {};
+    other.writes_ = {};
+    return *this;
   }
-  // Sum all values;
-  int64_t total = 0;
-  for (auto [_, val] : mem) {
-    total += val;
+
+  // Parses the text form of a program.
+  static Program Parse(std::istream& in) {
+    Program program;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::vector<absl::string_view> parts = absl::StrSplit(line, " = ");
+      CHECK_EQ(parts.size(), 2) << line;
+      if (parts[0] == "mask") {
+        CompiledMask mask = CompileMask(parts[1]);
+        mask.first_write = program.owned_writes_.size();
+        program.owned_masks_.push_back(mask);
+      } else {
+        CHECK(!program.owned_masks_.empty()) << "Write before any mask.";
+        // First part is mem[address], second part is the value.
+        auto mem_string =
+            absl::StripSuffix(absl::StripPrefix(parts[0], "mem["), "]");
+        Write write;
+        CHECK(absl::SimpleAtoi(mem_string, &write.address)) << line;
+        CHECK(absl::SimpleAtoi(parts[1], &write.value)) << line;
+        program.owned_writes_.push_back(write);
+        ++program.owned_masks_.back().write_count;
+      }
+    }
+    program.masks_ = program.owned_masks_;
+    program.writes_ = program.owned_writes_;
+    return program;
   }
-  return total;
+
+  // Maps in a program written by Save.
+  static Program Load(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    PCHECK(fd >= 0) << path;
+    struct stat st;
+    PCHECK(fstat(fd, &st) == 0) << path;
+    size_t size = st.st_size;
+    CHECK_GE(size, sizeof(Header)) << path << " is too small.";
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    PCHECK(data != MAP_FAILED) << path;
+    close(fd);
+
+    Program program;
+    program.mapping_.reset(static_cast<const char*>(data),
+                           [size](const char* p) {
+                             munmap(const_cast<char*>(p), size);
+                           });
+    const Header* header = reinterpret_cast<const Header*>(data);
+    CHECK(memcmp(header->magic, kMagic, sizeof(kMagic)) == 0)
+        << path << " isn't a compiled program.";
+    CHECK_EQ(header->version, kVersion) << path;
+    CHECK_EQ(size, sizeof(Header) + header->mask_count * sizeof(CompiledMask) +
+                       header->write_count * sizeof(Write))
+        << path << " is truncated.";
+    auto masks = reinterpret_cast<const CompiledMask*>(header + 1);
+    program.masks_ = absl::MakeConstSpan(masks, header->mask_count);
+    program.writes_ = absl::MakeConstSpan(
+        reinterpret_cast<const Write*>(masks + header->mask_count),
+        header->write_count);
+    return program;
+  }
+
+  void Save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    CHECK(out) << path;
+    Header header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.mask_count = masks_.size();
+    header.write_count = writes_.size();
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(masks_.data()),
+              masks_.size() * sizeof(CompiledMask));
+    out.write(reinterpret_cast<const char*>(writes_.data()),
+              writes_.size() * sizeof(Write));
+    CHECK(out) << "Failed writing " << path;
+  }
+
+  absl::Span<const CompiledMask> masks() const { return masks_; }
+
+  absl::Span<const Write> writes(const CompiledMask& mask) const {
+    return writes_.subspan(mask.first_write, mask.write_count);
+  }
+
+ private:
+  // The on-disk format is this header, then the masks, then the writes, all
+  // in native byte order.
+  static constexpr char kMagic[8] = {'D', 'A', 'Y', '1', '4', 'P', 'R', 'G'};
+  static constexpr uint64_t kVersion = 1;
+  struct Header {
+    char magic[8];
+    uint64_t version;
+    uint64_t mask_count;
+    uint64_t write_count;
+  };
+
+  // Either owned_* (if parsed) or mapping_ (if loaded) backs these.
+  absl::Span<const CompiledMask> masks_;
+  absl::Span<const Write> writes_;
+  std::vector<CompiledMask> owned_masks_;
+  std::vector<Write> owned_writes_;
+  std::shared_ptr<const char> mapping_;
+};
+
+template <typename MemoryT>
+int64_t DoPart1(const Program& program) {
+  MemoryT mem;
+
+  for (const auto& mask : program.masks()) {
+    for (const auto& [address, val] : program.writes(mask)) {
+      mem.Write(address, (val & mask.and_mask) | mask.or_mask);
+    }
+  }
+  return mem.Sum();
 }
 
 int FindFirstSetDigit(int64_t bitset) {
@@ -59,13 +301,14 @@ int FindFirstSetDigit(int64_t bitset) {
   CHECK(false);
 }
 
-void DoCombinationsFrom(Memory& mem, int64_t address, int64_t mask,
+template <typename MemoryT>
+void DoCombinationsFrom(MemoryT& mem, int64_t address, int64_t mask,
                         int64_t value) {
   int digit = FindFirstSetDigit(mask);
 
   // Tail case: just apply the value.
   if (digit == -1) {
-    mem[address] = value;
+    mem.Write(address, value);
     return;
   }
 
@@ -80,73 +323,147 @@ void DoCombinationsFrom(Memory& mem, int64_t address, int64_t mask,
   DoCombinationsFrom(mem, address_off, mask, value);
 }
 
-int64_t DoPart2(const std::vector<Instruction>& instructions) {
-  Memory mem;
+template <typename MemoryT>
+int64_t DoPart2(const Program& program) {
+  MemoryT mem;
 
-  for (auto [mask, writes] : instructions) {
-    // For the OR portion: convert Xs to 0s (ignore) and read in base 2.
-    int64_t or_mask;
-    CHECK(absl::numbers_internal::safe_strtoi_base(
-        absl::StrReplaceAll(mask, {{"X", "0"}}), &or_mask, 2));
+  for (const auto& mask : program.masks()) {
+    CHECK(mask.x_mask > 0);
+    for (const auto& [address, val] : program.writes(mask)) {
+      DoCombinationsFrom(mem, address | mask.or_mask, mask.x_mask, val);
+    }
+  }
+  return mem.Sum();
+}
+
+// A set of addresses as a ternary pattern: bits in |floating| can be either
+// value, the rest are the bits of |fixed| (which has the floating bits clear).
+struct AddressPattern {
+  int64_t fixed;
+  int64_t floating;
 
-    // Find all the xs by overwriting 1s to 0s and then Xs to 1s.
-    int64_t x_mask;
-    CHECK(absl::numbers_internal::safe_strtoi_base(
-        absl::StrReplaceAll(mask, {{"1", "0"}, {"X", "1"}}), &x_mask, 2));
-    CHECK(x_mask > 0);
+  int64_t Size() const { return 1ll << __builtin_popcountll(floating); }
+};
 
-    for (auto [address, val] : writes) {
-      address |= or_mask;
-      DoCombinationsFrom(mem, address, x_mask, val);
+// Returns |a| minus |b| as disjoint patterns. For each bit that floats in |a|
+// but is fixed in |b|, split off the half of |a| with the other value of that
+// bit (which can't be in |b|) and keep narrowing the rest towards |b|.
+void Subtract(AddressPattern a, AddressPattern b,
+              std::vector<AddressPattern>& out) {
+  int64_t both_fixed = ~a.floating & ~b.floating;
+  if ((a.fixed ^ b.fixed) & both_fixed) {
+    // Disjoint.
+    out.push_back(a);
+    return;
+  }
+  for (int64_t split = a.floating & ~b.floating; split != 0;
+       split &= split - 1) {
+    int64_t bit = split & -split;
+    a.floating &= ~bit;
+    out.push_back({(a.fixed & ~bit) | (~b.fixed & bit), a.floating});
+    a.fixed = (a.fixed & ~bit) | (b.fixed & bit);
+  }
+  // What's left of |a| is inside |b|.
+}
+
+// Part 2 without expanding floating addresses. Only the last write to an
+// address counts, so walk the writes in reverse: each write's contribution is
+// its value times the number of its addresses that no later write covers.
+// That count comes from subtracting every later write's pattern from this
+// one's, which stays small unless patterns overlap heavily, regardless of the
+// number of floating bits. With 36 floating bits and 36-bit values a single
+// write can contribute about 2^72, so the total is kept in 128 bits.
+absl::uint128 DoPart2Symbolic(const Program& program) {
+  std::vector<std::pair<AddressPattern, int64_t>> writes;
+  for (const auto& mask : program.masks()) {
+    for (const auto& [address, val] : program.writes(mask)) {
+      AddressPattern pattern = {
+          static_cast<int64_t>((address | mask.or_mask) & ~mask.x_mask),
+          static_cast<int64_t>(mask.x_mask)};
+      writes.push_back({pattern, static_cast<int64_t>(val)});
     }
   }
-  // Sum all values;
-  int64_t total = 0;
-  for (auto [_, val] : mem) {
-    total += val;
+
+  absl::uint128 total = 0;
+  std::vector<AddressPattern> later;
+  std::vector<AddressPattern> remaining;
+  std::vector<AddressPattern> next;
+  for (auto it = writes.rbegin(); it != writes.rend(); ++it) {
+    auto [pattern, val] = *it;
+    remaining = {pattern};
+    for (const auto& other : later) {
+      next.clear();
+      for (const auto& piece : remaining) Subtract(piece, other, next);
+      remaining.swap(next);
+      if (remaining.empty()) break;
+    }
+    for (const auto& piece : remaining) {
+      total += absl::uint128(static_cast<uint64_t>(val)) * piece.Size();
+    }
+    later.push_back(pattern);
   }
   return total;
 }
 
+// Runs the emulated parts with |MemoryT|, logging how long each took.
+template <typename MemoryT>
+void RunEmulated(const Program& program, bool expand_part2,
+                 absl::string_view name) {
+  auto time = [](auto func) {
+    auto start = std::chrono::steady_clock::now();
+    int64_t result = func();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return std::make_pair(result, elapsed.count());
+  };
+  auto [part1, part1_ms] = time([&]() { return DoPart1<MemoryT>(program); });
+  LOG(INFO) << "PART 1: " << part1;
+  if (!expand_part2) {
+    LOG(INFO) << absl::Substitute(
+        "  $0 memory: part 1 $1 ms, part 2 skipped", name, part1_ms);
+    return;
+  }
+  auto [part2, part2_ms] = time([&]() { return DoPart2<MemoryT>(program); });
+  LOG(INFO) << "PART 2: " << part2;
+  LOG(INFO) << absl::Substitute("  $0 memory: part 1 $1 ms, part 2 $2 ms",
+                                name, part1_ms, part2_ms);
+}
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
 
-  std::ifstream file(argv[1]);
-  CHECK(file);
-
-  std::string line;
-  std::vector<Instruction> instructions;
-  absl::optional<Instruction> instruction;
-  // Apply the masks as an and-mask to clear out places with zeros and an
-  // or-mask to add places with ones.
-  while (std::getline(file, line)) {
-    std::vector<absl::string_view> parts = absl::StrSplit(line, " = ");
-    if (parts[0] == "mask") {
-      if (instruction) {
-        instructions.push_back(*instruction);
-      }
-      instruction.emplace();
-      instruction->mask = parts[1];
-    } else {
-      CHECK(instruction);
-      // First part is mem[address], second part is the value.
-      auto mem_string =
-          absl::StripSuffix(absl::StripPrefix(parts[0], "mem["), "]");
-      int64_t address;
-      CHECK(absl::SimpleAtoi(mem_string, &address));
-      // Second part is just the value. Since we're guaranteed the AND and OR
-      // portions don't overlap, order doesn't matter.
-      int64_t val;
-      CHECK(absl::SimpleAtoi(parts[1], &val));
-      instruction->writes.emplace_back(address, val);
-    }
+  Program program;
+  if (FLAGS_compiled) {
+    program = Program::Load(argv[1]);
+  } else {
+    std::ifstream file(argv[1]);
+    CHECK(file);
+    program = Program::Parse(file);
+  }
+  if (!FLAGS_save_compiled.empty()) {
+    program.Save(FLAGS_save_compiled);
+  }
+
+  // Expanding every floating address is exponential in the number of Xs, so
+  // only do it for small masks.
+  int max_floating_bits = 0;
+  for (const auto& mask : program.masks()) {
+    max_floating_bits =
+        std::max(max_floating_bits, __builtin_popcountll(mask.x_mask));
+  }
+  bool expand_part2 = max_floating_bits <= FLAGS_max_expanded_floating_bits;
+  bool all = FLAGS_memory == "all";
+  CHECK(all || FLAGS_memory == "hash" || FLAGS_memory == "paged")
+      << "Unknown memory backend: " << FLAGS_memory;
+  if (all || FLAGS_memory == "hash") {
+    RunEmulated<HashMemory>(program, expand_part2, "hash");
   }
-  if (instruction) {
-    instructions.push_back(*instruction);
+  if (all || FLAGS_memory == "paged") {
+    RunEmulated<PagedMemory>(program, expand_part2, "paged");
   }
-  LOG(INFO) << "PART 1: " << DoPart1(instructions);
-  LOG(INFO) << "PART 2: " << DoPart2(instructions);
+  LOG(INFO) << "PART 2 symbolic: " << DoPart2Symbolic(program);
   return 0;
 }
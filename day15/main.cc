@@ -1,5 +1,14 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <execution>
 #include <fstream>
+#include <memory>
 #include <numeric>
 
 #include "absl/container/flat_hash_map.h"
@@ -10,8 +19,27 @@
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_uint64(turns, 30000000, "The turn to report for part 2.");
+DEFINE_string(report_turns, "",
+              "Comma-separated extra turns to report the spoken number for, "
+              "in the same run.");
+DEFINE_string(engine, "dense",
+              "'dense' for the array-backed engine, 'hash' for the original "
+              "hash map.");
+DEFINE_uint64(small_values, 1 << 18,
+              "Values below this are kept in their own last-seen array, small "
+              "enough to stay in cache.");
+DEFINE_string(checkpoint, "",
+              "If set, the dense engine periodically checkpoints to "
+              "<checkpoint>.0 and <checkpoint>.1.");
+DEFINE_uint64(checkpoint_interval, 100000000,
+              "Number of turns between checkpoints.");
+DEFINE_bool(resume, false,
+            "Resume from the newest complete checkpoint, if there is one.");
+
 int DistanceToLast(const absl::flat_hash_map<int64_t, int64_t>& last_seen,
                    int64_t value, int index) {
   auto it = last_seen.find(value);
@@ -21,41 +49,420 @@ int DistanceToLast(const absl::flat_hash_map<int64_t, int64_t>& last_seen,
   return index - it->second;
 }
 
+// A file holding a copy of a VanEckEngine's state, mapped shared so that
+// saving it is an msync. Pages of the file that were never written are holes,
+// so a checkpoint of a mostly empty table is mostly empty on disk.
+class CheckpointFile {
+ public:
+  struct Header {
+    char magic[8];
+    uint64_t version;
+    uint64_t max_turn;
+    uint64_t small_size;
+    // FNV-1a of the starting numbers, so a checkpoint is only resumed for
+    // the game it was written for.
+    uint64_t starting_hash;
+    uint64_t turn;
+    uint32_t last;
+    // Set once the state below matches |turn| and |last|.
+    uint32_t complete;
+  };
+  // The state starts on its own page.
+  static constexpr size_t kStateOffset = 4096;
+
+  // Nothing is opened until the file is either read back with
+  // ReadComplete() and Open()ed, or Reset().
+  CheckpointFile(const std::string& path, size_t state_bytes)
+      : path_(path), size_(kStateOffset + state_bytes) {}
+
+  ~CheckpointFile() {
+    if (data_ != nullptr) munmap(data_, size_);
+  }
+
+  Header& header() { return *reinterpret_cast<Header*>(data_); }
+  char* state() { return data_ + kStateOffset; }
+
+  // Returns the header if the file holds a complete checkpoint of the game
+  // with |starting_hash|, played by an engine with the given layout. The file
+  // is only read: a checkpoint with a different layout fails a CHECK before
+  // anything could overwrite it.
+  absl::optional<Header> ReadComplete(uint64_t max_turn, uint64_t small_size,
+                                      uint64_t starting_hash) const {
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0) {
+      PCHECK(errno == ENOENT) << path_;
+      return absl::nullopt;
+    }
+    Header h;
+    ssize_t read = pread(fd, &h, sizeof(h), 0);
+    PCHECK(read >= 0) << path_;
+    struct stat st;
+    PCHECK(fstat(fd, &st) == 0) << path_;
+    close(fd);
+    if (read != sizeof(h) || memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 ||
+        !h.complete) {
+      return absl::nullopt;
+    }
+    CHECK_EQ(h.version, kVersion) << path_;
+    if (h.starting_hash != starting_hash) {
+      LOG(WARNING) << path_ << " is for different starting numbers.";
+      return absl::nullopt;
+    }
+    CHECK(h.max_turn == max_turn && h.small_size == small_size)
+        << path_ << " was written with different --turns/--report_turns or "
+        << "--small_values.";
+    CHECK_EQ(st.st_size, size_) << path_ << " is truncated.";
+    return h;
+  }
+
+  // Maps the existing file, which ReadComplete() has checked, as it is.
+  void Open() { Map(O_RDWR); }
+
+  // Creates the file or empties an existing one, so the state reads as all
+  // zeros (a fresh engine) and only chunks that are written from now on
+  // differ from it, then maps it.
+  void Reset() { Map(O_RDWR | O_CREAT | O_TRUNC); }
+
+  // Marks the checkpoint incomplete (durably) before its state is changed.
+  void Invalidate() {
+    header().complete = 0;
+    Sync(0, kStateOffset);
+  }
+
+  // Flushes |length| bytes of the file at |offset| to disk.
+  void Sync(size_t offset, size_t length) {
+    size_t page_offset = offset & ~size_t{4095};
+    PCHECK(msync(data_ + page_offset, length + offset - page_offset,
+                 MS_SYNC) == 0)
+        << path_;
+  }
+
+  // Records that the state matches |turn| and |last|.
+  void Complete(uint64_t max_turn, uint64_t small_size,
+                uint64_t starting_hash, uint64_t turn, uint32_t last) {
+    Header& h = header();
+    memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.max_turn = max_turn;
+    h.small_size = small_size;
+    h.starting_hash = starting_hash;
+    h.turn = turn;
+    h.last = last;
+    h.complete = 1;
+    Sync(0, kStateOffset);
+  }
+
+ private:
+  static constexpr char kMagic[8] = {'D', 'A', 'Y', '1', '5', 'C', 'K', 'P'};
+  static constexpr uint64_t kVersion = 2;
+
+  void Map(int flags) {
+    CHECK(data_ == nullptr) << path_;
+    int fd = open(path_.c_str(), flags, 0644);
+    PCHECK(fd >= 0) << path_;
+    struct stat st;
+    PCHECK(fstat(fd, &st) == 0) << path_;
+    if (st.st_size != size_) {
+      PCHECK(ftruncate(fd, size_) == 0) << path_;
+    }
+    void* data =
+        mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PCHECK(data != MAP_FAILED) << path_;
+    close(fd);
+    data_ = static_cast<char*>(data);
+  }
+
+  std::string path_;
+  size_t size_;
+  char* data_ = nullptr;
+};
+
+// Plays the game with last-seen turns kept in arrays indexed by value. Every
+// value spoken is a distance between turns, so it's smaller than the turn
+// count and the arrays can be sized up front.
+//
+// Low values are spoken over and over, so they get their own small array
+// that stays in cache. Most large values are only ever spoken once, so a
+// bitset (1 bit per value, much smaller than the array) records which have
+// been seen: a first sighting only writes to the large array, never reads it.
+// The arrays live in one anonymous mapping, so pages that are never touched
+// are never faulted in.
+//
+// With checkpoints enabled, the state is copied into one of two checkpoint
+// files in turn. Writing the live table in place would not be crash-safe: the
+// kernel can write back pages from after the last checkpoint at any time.
+// Alternating files means there's always one complete checkpoint, even if
+// the process dies while saving the other. Only chunks of the table that
+// changed since a file was last saved are copied into it.
+class VanEckEngine {
+ public:
+  explicit VanEckEngine(uint64_t max_turn)
+      : max_turn_(max_turn),
+        small_size_(std::min<uint64_t>(FLAGS_small_values, max_turn)),
+        seen_words_((max_turn + 31) / 32),
+        state_words_(small_size_ + seen_words_ + max_turn),
+        dirty_((state_words_ >> kChunkShift) + 1, 0) {
+    CHECK_LT(max_turn, uint64_t{1} << 32) << "Turns must fit in 32 bits.";
+    void* data = mmap(nullptr, state_bytes(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    PCHECK(data != MAP_FAILED);
+    state_ = static_cast<uint32_t*>(data);
+  }
+
+  ~VanEckEngine() { munmap(state_, state_bytes()); }
+
+  // Speaks the starting numbers.
+  void Start(const std::vector<uint32_t>& starting) {
+    CHECK(!starting.empty());
+    CHECK_GE(max_turn_, starting.size());
+    starting_hash_ = 0xcbf29ce484222325;
+    for (uint32_t number : starting) {
+      starting_hash_ = (starting_hash_ ^ number) * 0x100000001b3;
+      if (turn_ > 0) Exchange<true>(last_, turn_);
+      CHECK_LT(number, max_turn_);
+      last_ = number;
+      ++turn_;
+    }
+  }
+
+  // Checkpoints to <prefix>.0 and <prefix>.1 every |interval| turns. If
+  // |resume|, first loads the newest complete checkpoint of this game and
+  // returns true. Otherwise, or if there isn't one, both files are emptied:
+  // only chunks changed by this run are copied into them, so anything left
+  // from an earlier run would otherwise end up in a "complete" checkpoint.
+  bool EnableCheckpoints(const std::string& prefix, uint64_t interval,
+                         bool resume) {
+    CHECK_GT(interval, 0);
+    for (int i = 0; i < 2; ++i) {
+      files_[i] = std::make_unique<CheckpointFile>(absl::StrCat(prefix, ".", i),
+                                                   state_bytes());
+    }
+    checkpoint_interval_ = interval;
+    if (resume && Resume()) return true;
+    for (int i = 0; i < 2; ++i) files_[i]->Reset();
+    return false;
+  }
+
+  // Plays until |turn| (1-based) has been spoken, checkpointing along the
+  // way if enabled.
+  void RunUntil(uint64_t turn) {
+    CHECK_LE(turn, max_turn_);
+    if (!files_[0]) {
+      Run<false>(turn);
+      return;
+    }
+    while (turn_ < turn) {
+      uint64_t next_checkpoint =
+          (turn_ / checkpoint_interval_ + 1) * checkpoint_interval_;
+      Run<true>(std::min(turn, next_checkpoint));
+      if (turn_ == next_checkpoint) Checkpoint();
+    }
+  }
+
+  // The turn most recently played and the number spoken on it.
+  uint64_t turn() const { return turn_; }
+  uint32_t last() const { return last_; }
+
+ private:
+  // Dirty tracking is per chunk of 2^kChunkShift state words, with a bit per
+  // checkpoint file.
+  static constexpr int kChunkShift = 14;
+  static uint8_t DirtyBit(int file) { return 1 << file; }
+
+  size_t state_bytes() const { return state_words_ * sizeof(uint32_t); }
+
+  // Loads the newest complete checkpoint. Returns false if there isn't one.
+  bool Resume() {
+    absl::optional<CheckpointFile::Header> headers[2];
+    int newest = -1;
+    for (int i = 0; i < 2; ++i) {
+      headers[i] =
+          files_[i]->ReadComplete(max_turn_, small_size_, starting_hash_);
+      if (!headers[i]) continue;
+      if (newest < 0 || headers[i]->turn > headers[newest]->turn) {
+        newest = i;
+      }
+    }
+    if (newest < 0) return false;
+
+    CheckpointFile& file = *files_[newest];
+    file.Open();
+    memcpy(state_, file.state(), state_bytes());
+    turn_ = headers[newest]->turn;
+    last_ = headers[newest]->last;
+    // The newest file matches the state. The other one is older by an
+    // unknown set of chunks, so it has to be rewritten in full.
+    files_[1 - newest]->Reset();
+    std::fill(dirty_.begin(), dirty_.end(), DirtyBit(1 - newest));
+    next_file_ = 1 - newest;
+    return true;
+  }
+
+  // The inner loop, instantiated with and without dirty tracking so there's
+  // no cost when checkpoints are off.
+  template <bool kTrackDirty>
+  void Run(uint64_t turn) {
+    uint32_t current = turn_;
+    uint32_t last = last_;
+    for (; current < turn; ++current) {
+      uint32_t previous = Exchange<kTrackDirty>(last, current);
+      last = previous == 0 ? 0 : current - previous;
+    }
+    turn_ = current;
+    last_ = last;
+  }
+
+  template <bool kTrackDirty>
+  void MarkDirty(uint64_t word) {
+    if (kTrackDirty) dirty_[word >> kChunkShift] = DirtyBit(0) | DirtyBit(1);
+  }
+
+  // Records that |value| was spoken on |turn| and returns the turn it was
+  // previously spoken on, or 0 if never.
+  template <bool kTrackDirty>
+  uint32_t Exchange(uint32_t value, uint32_t turn) {
+    if (value < small_size_) {
+      uint32_t previous = state_[value];
+      state_[value] = turn;
+      MarkDirty<kTrackDirty>(value);
+      return previous;
+    }
+    uint64_t seen_word = small_size_ + value / 32;
+    uint32_t bit = uint32_t{1} << (value % 32);
+    uint64_t large_word = small_size_ + seen_words_ + value;
+    uint32_t previous = (state_[seen_word] & bit) ? state_[large_word] : 0;
+    state_[seen_word] |= bit;
+    state_[large_word] = turn;
+    MarkDirty<kTrackDirty>(seen_word);
+    MarkDirty<kTrackDirty>(large_word);
+    return previous;
+  }
+
+  // Copies the chunks that changed since the next file was last saved into
+  // it, syncing each, then marks it complete.
+  void Checkpoint() {
+    auto start = std::chrono::steady_clock::now();
+    CheckpointFile& file = *files_[next_file_];
+    const uint8_t bit = DirtyBit(next_file_);
+    const size_t chunk_bytes = sizeof(uint32_t) << kChunkShift;
+    file.Invalidate();
+    int64_t copied = 0;
+    for (size_t chunk = 0; chunk < dirty_.size(); ++chunk) {
+      if (!(dirty_[chunk] & bit)) continue;
+      dirty_[chunk] &= ~bit;
+      size_t offset = chunk * chunk_bytes;
+      size_t length = std::min(chunk_bytes, state_bytes() - offset);
+      memcpy(file.state() + offset, reinterpret_cast<char*>(state_) + offset,
+             length);
+      file.Sync(CheckpointFile::kStateOffset + offset, length);
+      ++copied;
+    }
+    file.Complete(max_turn_, small_size_, starting_hash_, turn_, last_);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    LOG(INFO) << absl::Substitute("Checkpointed turn $0 ($1 chunks, $2 s)",
+                                  turn_, copied, elapsed.count());
+    next_file_ = 1 - next_file_;
+  }
+
+  uint64_t max_turn_;
+  uint64_t small_size_;
+  uint64_t seen_words_;
+  // The state is the small array, then the seen bitset, then the large array.
+  uint64_t state_words_;
+  uint32_t* state_;
+  uint64_t turn_ = 0;
+  uint32_t last_ = 0;
+  uint64_t starting_hash_ = 0;
+
+  std::unique_ptr<CheckpointFile> files_[2];
+  uint64_t checkpoint_interval_ = 0;
+  int next_file_ = 0;
+  std::vector<uint8_t> dirty_;
+};
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
 
-  absl::flat_hash_map<int64_t, int64_t> last_seen;
-
   std::ifstream file(argv[1]);
   CHECK(file);
   std::string line;
   CHECK(std::getline(file, line));
-
-  int index = 0;
-  int64_t last_value = -1;
+  std::vector<uint32_t> starting;
   for (auto input : absl::StrSplit(line, ",")) {
-    int64_t number;
+    uint32_t number;
     CHECK(absl::SimpleAtoi(input, &number));
-    if (last_value >= 0) {
-      last_seen[last_value] = index;
-    }
-    last_value = number;
-    ++index;
+    starting.push_back(number);
   }
-  // We start by looking at the *last* number, so clear it out of the map.
-  last_seen.erase(last_value);
 
-  for (; index <= 29999999; ++index) {
-    int64_t next = DistanceToLast(last_seen, last_value, index);
-    if (index == 2019) {
-      LOG(INFO) << "PART 1: " << next;
+  auto start = std::chrono::steady_clock::now();
+  uint64_t played = FLAGS_turns - starting.size();
+  if (FLAGS_engine == "dense") {
+    // Every turn to report, in order, with its label.
+    std::vector<std::pair<uint64_t, std::string>> reports = {
+        {2020, "PART 1"}, {FLAGS_turns, "PART 2"}};
+    if (!FLAGS_report_turns.empty()) {
+      for (auto turn_string : absl::StrSplit(FLAGS_report_turns, ",")) {
+        uint64_t turn;
+        CHECK(absl::SimpleAtoi(turn_string, &turn)) << turn_string;
+        reports.push_back({turn, absl::StrCat("TURN ", turn)});
+      }
     }
-    last_seen[last_value] = index;
-    last_value = next;
-  }
+    std::sort(reports.begin(), reports.end());
+    uint64_t max_turn = reports.back().first;
 
-  LOG(INFO) << "PART 2: " << last_value;
+    VanEckEngine engine(max_turn);
+    engine.Start(starting);
+    if (!FLAGS_checkpoint.empty()) {
+      if (engine.EnableCheckpoints(FLAGS_checkpoint,
+                                   FLAGS_checkpoint_interval, FLAGS_resume)) {
+        LOG(INFO) << "Resumed at turn " << engine.turn();
+      }
+    }
+    played = max_turn - engine.turn();
+    for (const auto& [turn, label] : reports) {
+      if (turn < engine.turn()) {
+        LOG(WARNING) << label << ": turn " << turn << " was before the resume.";
+        continue;
+      }
+      engine.RunUntil(turn);
+      LOG(INFO) << label << ": " << engine.last();
+    }
+  } else {
+    CHECK_EQ(FLAGS_engine, "hash") << "Unknown engine.";
+    absl::flat_hash_map<int64_t, int64_t> last_seen;
+    int index = 0;
+    int64_t last_value = -1;
+    for (uint32_t number : starting) {
+      if (last_value >= 0) {
+        last_seen[last_value] = index;
+      }
+      last_value = number;
+      ++index;
+    }
+    // We start by looking at the *last* number, so clear it out of the map.
+    last_seen.erase(last_value);
+
+    for (; index < FLAGS_turns; ++index) {
+      int64_t next = DistanceToLast(last_seen, last_value, index);
+      if (index == 2019) {
+        LOG(INFO) << "PART 1: " << next;
+      }
+      last_seen[last_value] = index;
+      last_value = next;
+    }
+
+    LOG(INFO) << "PART 2: " << last_value;
+  }
+  // A resume at the last turn plays nothing, so there's no rate to report.
+  if (played > 0) {
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    LOG(INFO) << absl::Substitute("$0 turns, $1 ns/turn", played,
+                                  elapsed.count() / played);
+  }
   return 0;
 }
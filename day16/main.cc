@@ -1,17 +1,28 @@
+#include <algorithm>
 #include <execution>
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <numeric>
+#include <thread>
 
-#include "absl/container/flat_hash_map.h"
-#include "absl/container/flat_hash_set.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_int64(max_table_value, 1 << 20,
+             "Largest rule endpoint for which ticket values are looked up in a "
+             "dense value->rules table; wider rules use a sorted interval "
+             "index instead.");
+DEFINE_int32(threads, std::thread::hardware_concurrency(),
+             "Number of threads to ingest nearby tickets with.");
+
 typedef std::vector<int64_t> Ticket;
 
 struct Rule {
@@ -19,9 +30,9 @@ struct Rule {
   std::vector<std::pair<int64_t, int64_t>> ranges;
 };
 
-Ticket ParseTicket(std::string line) {
+Ticket ParseTicket(const std::string& line) {
   Ticket ticket;
-  int number;
+  int64_t number;
   for (auto part : absl::StrSplit(line, ",")) {
     CHECK(absl::SimpleAtoi(part, &number)) << part;
     ticket.push_back(number);
@@ -29,51 +40,489 @@ Ticket ParseTicket(std::string line) {
   return ticket;
 }
 
-Rule ParseRule(std::string line) {
+Rule ParseRule(const std::string& line) {
   Rule rule;
   std::vector<std::string> parts = absl::StrSplit(line, ": ");
   CHECK(parts.size() == 2);
   rule.name = parts[0];
+  // Split into a separate vector: |part| points into parts[1].
   for (auto part : absl::StrSplit(parts[1], " or ")) {
-    parts = absl::StrSplit(part, "-");
-    CHECK(parts.size() == 2) << part;
+    std::vector<absl::string_view> bounds = absl::StrSplit(part, "-");
+    CHECK(bounds.size() == 2) << part;
     int64_t min, max;
-    CHECK(absl::SimpleAtoi(parts[0], &min));
-    CHECK(absl::SimpleAtoi(parts[1], &max));
+    CHECK(absl::SimpleAtoi(bounds[0], &min));
+    CHECK(absl::SimpleAtoi(bounds[1], &max));
+    CHECK_LE(min, max) << part;
     rule.ranges.push_back({min, max});
   }
   return rule;
 }
 
-bool RuleMatches(Rule rule, int64_t value) {
-  for (auto [min, max] : rule.ranges) {
-    if (value >= min && value <= max) {
-      return true;
+// Maps a ticket value to the set of rules that accept it, as a bitmask of
+// words() uint64s (bit r is rules[r]), so checking a field is a single lookup
+// instead of a scan over every rule's ranges.
+//
+// When every range fits in [0, max_table_value] the masks live in a dense
+// table indexed by value. Otherwise the range endpoints split the number line
+// into elementary intervals that each have a fixed mask, and a value is found
+// by binary search over the interval starts.
+class RuleIndex {
+ public:
+  RuleIndex(const std::vector<Rule>& rules, int64_t max_table_value)
+      : words_((rules.size() + 63) / 64), none_(words_, 0) {
+    int64_t lowest = 0, highest = 0;
+    for (const auto& rule : rules) {
+      for (auto [min, max] : rule.ranges) {
+        lowest = std::min(lowest, min);
+        highest = std::max(highest, max);
+      }
     }
-  }
-  return false;
-}
 
-bool CheckValidity(const std::vector<Rule>& rules, Ticket ticket,
-                   int64_t& error_rate) {
-  bool valid = true;
-  for (auto val : ticket) {
-    bool matches_one = false;
-    for (auto rule : rules) {
-      if (RuleMatches(rule, val)) {
-        matches_one = true;
-        break;
+    if (lowest >= 0 && highest <= max_table_value) {
+      table_size_ = highest + 1;
+      table_.assign(table_size_ * words_, 0);
+      for (int r = 0; r < rules.size(); ++r) {
+        for (auto [min, max] : rules[r].ranges) {
+          for (int64_t v = min; v <= max; ++v) {
+            table_[v * words_ + r / 64] |= uint64_t{1} << (r % 64);
+          }
+        }
+      }
+      return;
+    }
+
+    for (const auto& rule : rules) {
+      for (auto [min, max] : rule.ranges) {
+        starts_.push_back(min);
+        starts_.push_back(max + 1);
+      }
+    }
+    std::sort(starts_.begin(), starts_.end());
+    starts_.erase(std::unique(starts_.begin(), starts_.end()), starts_.end());
+    // The last start only ends the final range, so its mask stays empty.
+    interval_masks_.assign(starts_.size() * words_, 0);
+    for (int r = 0; r < rules.size(); ++r) {
+      for (auto [min, max] : rules[r].ranges) {
+        auto first = std::lower_bound(starts_.begin(), starts_.end(), min);
+        auto last = std::lower_bound(first, starts_.end(), max + 1);
+        for (auto it = first; it != last; ++it) {
+          interval_masks_[(it - starts_.begin()) * words_ + r / 64] |=
+              uint64_t{1} << (r % 64);
+        }
       }
     }
-    if (!matches_one) {
-      error_rate += val;
+  }
+
+  int words() const { return words_; }
+  bool dense() const { return starts_.empty(); }
+
+  // Returns words() mask words for |value|; all zero if no rule accepts it.
+  const uint64_t* Lookup(int64_t value) const {
+    if (dense()) {
+      if (value < 0 || value >= table_size_) return none_.data();
+      return &table_[value * words_];
+    }
+    auto it = std::upper_bound(starts_.begin(), starts_.end(), value);
+    if (it == starts_.begin()) return none_.data();
+    return &interval_masks_[(it - starts_.begin() - 1) * words_];
+  }
+
+  bool Any(const uint64_t* mask) const {
+    uint64_t any = 0;
+    for (int w = 0; w < words_; ++w) any |= mask[w];
+    return any != 0;
+  }
+
+ private:
+  int words_;
+  std::vector<uint64_t> none_;
+
+  int64_t table_size_ = 0;
+  std::vector<uint64_t> table_;
+
+  std::vector<int64_t> starts_;
+  std::vector<uint64_t> interval_masks_;
+};
+
+// Looks up every field of |ticket| once, adding the fields no rule accepts to
+// |error_rate|. For a valid ticket the field masks are ANDed into
+// |candidates| (words() per column), which after all tickets holds for each
+// column the rules that every valid ticket satisfies there. |masks| is
+// scratch space reused between tickets.
+bool CheckAndIntersect(const RuleIndex& index, absl::Span<const int32_t> ticket,
+                       std::vector<const uint64_t*>& masks,
+                       std::vector<uint64_t>& candidates,
+                       int64_t& error_rate) {
+  const int words = index.words();
+  CHECK_EQ(ticket.size() * words, candidates.size());
+  masks.resize(ticket.size());
+  bool valid = true;
+  for (int i = 0; i < ticket.size(); ++i) {
+    masks[i] = index.Lookup(ticket[i]);
+    if (!index.Any(masks[i])) {
+      error_rate += ticket[i];
       valid = false;
     }
   }
-  return valid;
+  if (!valid) return false;
+
+  uint64_t* out = candidates.data();
+  for (int i = 0; i < ticket.size(); ++i, out += words) {
+    const uint64_t* mask = masks[i];
+    for (int w = 0; w < words; ++w) out[w] &= mask[w];
+  }
+  return true;
 }
 
+// Nearby tickets, one row of |columns| values each, in a single allocation.
+struct TicketMatrix {
+  int columns = 0;
+  std::vector<int32_t> values;
+
+  int64_t rows() const { return values.size() / columns; }
+  absl::Span<const int32_t> row(int64_t r) const {
+    return absl::MakeConstSpan(&values[r * columns], columns);
+  }
+};
+
+// What a chunk of tickets contributes to both parts.
+struct TicketSummary {
+  int64_t error_rate = 0;
+  int64_t valid = 0;
+  std::vector<uint64_t> candidates;
+};
+
+// Calls |f| with every non-empty line of |text|.
+template <typename F>
+void ForEachLine(absl::string_view text, F f) {
+  while (!text.empty()) {
+    auto end = text.find('\n');
+    absl::string_view line = text.substr(0, end);
+    text.remove_prefix(end == absl::string_view::npos ? text.size() : end + 1);
+    line = absl::StripSuffix(line, "\r");
+    if (!line.empty()) f(line);
+  }
+}
+
+void ParseTicketInto(absl::string_view line, int columns, int32_t* out) {
+  int column = 0;
+  for (auto part : absl::StrSplit(line, ",")) {
+    CHECK_LT(column, columns) << line;
+    CHECK(absl::SimpleAtoi(part, &out[column++])) << part;
+  }
+  CHECK_EQ(column, columns) << line;
+}
+
+// Parses the nearby ticket lines in |text| into |tickets| and summarizes
+// them. |text| is split into newline-aligned chunks, one per thread. Each
+// thread first counts its rows; once every chunk's offset into the shared
+// matrix is known, it parses its rows in place and folds them into its own
+// error rate and candidate masks, which are merged at the end. Every ticket
+// is parsed exactly once.
+TicketSummary IngestTickets(absl::string_view text, const RuleIndex& index,
+                            int columns, int threads,
+                            TicketMatrix& tickets) {
+  threads = std::max<int64_t>(1, std::min<int64_t>(threads, text.size()));
+  std::vector<absl::string_view> chunks;
+  size_t begin = 0;
+  for (int t = 1; t <= threads; ++t) {
+    size_t end = text.size() * t / threads;
+    if (end < begin) end = begin;
+    end = text.find('\n', end);
+    end = end == absl::string_view::npos ? text.size() : end + 1;
+    chunks.push_back(text.substr(begin, end - begin));
+    begin = end;
+  }
+
+  auto run = [&](auto work) {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < chunks.size(); ++t) workers.emplace_back(work, t);
+    for (auto& worker : workers) worker.join();
+  };
+
+  std::vector<int64_t> first_row(chunks.size() + 1, 0);
+  run([&](int t) {
+    ForEachLine(chunks[t], [&](absl::string_view) { ++first_row[t + 1]; });
+  });
+  std::partial_sum(first_row.begin(), first_row.end(), first_row.begin());
+
+  tickets.columns = columns;
+  tickets.values.resize(first_row.back() * columns);
+  std::vector<TicketSummary> summaries(chunks.size());
+  run([&](int t) {
+    TicketSummary& summary = summaries[t];
+    summary.candidates.assign(columns * index.words(), ~uint64_t{0});
+    std::vector<const uint64_t*> masks;
+    int64_t r = first_row[t];
+    ForEachLine(chunks[t], [&](absl::string_view line) {
+      ParseTicketInto(line, columns, &tickets.values[r * columns]);
+      summary.valid += CheckAndIntersect(index, tickets.row(r), masks,
+                                         summary.candidates,
+                                         summary.error_rate);
+      ++r;
+    });
+    CHECK_EQ(r, first_row[t + 1]);
+  });
+
+  TicketSummary total = std::move(summaries[0]);
+  for (int t = 1; t < summaries.size(); ++t) {
+    total.error_rate += summaries[t].error_rate;
+    total.valid += summaries[t].valid;
+    for (int i = 0; i < total.candidates.size(); ++i) {
+      total.candidates[i] &= summaries[t].candidates[i];
+    }
+  }
+  return total;
+}
+
+// A dense rows x cols bit matrix, one run of uint64 words per row.
+class BitMatrix {
+ public:
+  BitMatrix(int rows, int cols)
+      : words_((cols + 63) / 64), bits_(rows * words_, 0) {}
+
+  bool Get(int r, int c) const {
+    return (bits_[r * words_ + c / 64] >> (c % 64)) & 1;
+  }
+  void Set(int r, int c) {
+    bits_[r * words_ + c / 64] |= uint64_t{1} << (c % 64);
+  }
+  void Clear(int r, int c) {
+    bits_[r * words_ + c / 64] &= ~(uint64_t{1} << (c % 64));
+  }
+
+  int Count(int r) const {
+    int count = 0;
+    for (int w = 0; w < words_; ++w) {
+      count += __builtin_popcountll(bits_[r * words_ + w]);
+    }
+    return count;
+  }
+
+  // First set column >= |from| in row |r|, or -1.
+  int Next(int r, int from) const {
+    int w = from / 64;
+    if (w >= words_) return -1;
+    uint64_t word = bits_[r * words_ + w] & (~uint64_t{0} << (from % 64));
+    while (true) {
+      if (word) return w * 64 + __builtin_ctzll(word);
+      if (++w == words_) return -1;
+      word = bits_[r * words_ + w];
+    }
+  }
+
+ private:
+  int words_;
+  std::vector<uint64_t> bits_;
+};
+
+// Assigns each rule a column given the candidate masks, keeping the
+// candidates both ways around (rule -> columns and column -> rules) so
+// either side can be checked for a single remaining option.
+class FieldSolver {
+ public:
+  FieldSolver(const std::vector<uint64_t>& candidates, int words,
+              int rule_count, int column_count)
+      : rule_count_(rule_count),
+        column_count_(column_count),
+        rule_columns_(rule_count, column_count),
+        column_rules_(column_count, rule_count),
+        column_of_rule_(rule_count, -1),
+        rule_of_column_(column_count, -1) {
+    for (int c = 0; c < column_count; ++c) {
+      for (int r = 0; r < rule_count; ++r) {
+        if ((candidates[c * words + r / 64] >> (r % 64)) & 1) {
+          rule_columns_.Set(r, c);
+          column_rules_.Set(c, r);
+        }
+      }
+    }
+  }
+
+  // Treat this like simplest sudoku (also how windiff works, sorta): a rule
+  // with a single candidate column, or a column with a single candidate rule,
+  // is a definite match, and taking it removes both from everyone else's
+  // candidates, which may leave more singles. Returns how many rules were
+  // matched this way. Unlike the old loop this stops when nothing is forced
+  // instead of spinning; Match() finishes the job.
+  //
+  // For the curious: Windiff's version of this is: find a line that matches
+  // uniquely and add them to the match set. Walk lines forwards and backwards
+  // from that line and add them to the match set as long as they match. When
+  // complete, anything that remains is an added/removed line.
+  int Propagate() {
+    // Rules are queued as r, columns as rule_count_ + c.
+    std::vector<int> queue;
+    for (int r = 0; r < rule_count_; ++r) {
+      if (rule_columns_.Count(r) == 1) queue.push_back(r);
+    }
+    for (int c = 0; c < column_count_; ++c) {
+      if (column_rules_.Count(c) == 1) queue.push_back(rule_count_ + c);
+    }
+
+    int forced = 0;
+    while (!queue.empty()) {
+      int node = queue.back();
+      queue.pop_back();
+      int r, c;
+      if (node < rule_count_) {
+        r = node;
+        c = rule_columns_.Next(r, 0);
+      } else {
+        c = node - rule_count_;
+        r = column_rules_.Next(c, 0);
+      }
+      // Already taken, or emptied by a conflicting assignment (which leaves
+      // the schema unsatisfiable; Match() reports it).
+      if (r < 0 || c < 0 || column_of_rule_[r] >= 0 ||
+          rule_of_column_[c] >= 0) {
+        continue;
+      }
+
+      column_of_rule_[r] = c;
+      rule_of_column_[c] = r;
+      ++forced;
+      for (int c2 = rule_columns_.Next(r, 0); c2 >= 0;
+           c2 = rule_columns_.Next(r, c2 + 1)) {
+        if (c2 == c) continue;
+        rule_columns_.Clear(r, c2);
+        column_rules_.Clear(c2, r);
+        if (column_rules_.Count(c2) == 1) queue.push_back(rule_count_ + c2);
+      }
+      for (int r2 = column_rules_.Next(c, 0); r2 >= 0;
+           r2 = column_rules_.Next(c, r2 + 1)) {
+        if (r2 == r) continue;
+        column_rules_.Clear(c, r2);
+        rule_columns_.Clear(r2, c);
+        if (rule_columns_.Count(r2) == 1) queue.push_back(r2);
+      }
+    }
+    return forced;
+  }
+
+  // Harder sudoku end up with no single to take, so extend whatever
+  // Propagate() forced to a maximum matching with Hopcroft-Karp. Returns the
+  // number of rules matched; fewer than there are rules or columns means the
+  // schema is unsatisfiable.
+  int Match() {
+    constexpr int kUnreached = std::numeric_limits<int>::max();
+    std::vector<int> dist(rule_count_);
+    std::vector<int> queue;
+
+    // Layers free rules by alternating path length; true if some path can
+    // reach a free column.
+    auto bfs = [&]() {
+      queue.clear();
+      for (int r = 0; r < rule_count_; ++r) {
+        dist[r] = column_of_rule_[r] < 0 ? 0 : kUnreached;
+        if (dist[r] == 0) queue.push_back(r);
+      }
+      bool found = false;
+      for (int i = 0; i < queue.size(); ++i) {
+        int r = queue[i];
+        for (int c = rule_columns_.Next(r, 0); c >= 0;
+             c = rule_columns_.Next(r, c + 1)) {
+          int next = rule_of_column_[c];
+          if (next < 0) {
+            found = true;
+          } else if (dist[next] == kUnreached) {
+            dist[next] = dist[r] + 1;
+            queue.push_back(next);
+          }
+        }
+      }
+      return found;
+    };
+
+    // Augments along a shortest path from |r|, following the BFS layers.
+    std::function<bool(int)> dfs = [&](int r) {
+      for (int c = rule_columns_.Next(r, 0); c >= 0;
+           c = rule_columns_.Next(r, c + 1)) {
+        int next = rule_of_column_[c];
+        if (next < 0 || (dist[next] == dist[r] + 1 && dfs(next))) {
+          column_of_rule_[r] = c;
+          rule_of_column_[c] = r;
+          return true;
+        }
+      }
+      dist[r] = kUnreached;
+      return false;
+    };
+
+    while (bfs()) {
+      for (int r = 0; r < rule_count_; ++r) {
+        if (column_of_rule_[r] < 0) dfs(r);
+      }
+    }
+    return rule_count_ - std::count(column_of_rule_.begin(),
+                                    column_of_rule_.end(), -1);
+  }
+
+  // Rules whose column differs between perfect matchings. Those are exactly
+  // the rules on an alternating cycle: walk rule -> candidate column along
+  // unmatched edges and column -> rule along matched ones, and a rule is
+  // ambiguous iff its strongly connected component isn't just itself.
+  std::vector<int> AmbiguousRules() const {
+    const int node_count = rule_count_ + column_count_;
+    std::vector<int> index(node_count, -1), low(node_count), stack;
+    std::vector<bool> on_stack(node_count, false);
+    std::vector<int> ambiguous;
+    int next_index = 0;
+
+    // Tarjan's algorithm.
+    std::function<void(int)> visit = [&](int node) {
+      index[node] = low[node] = next_index++;
+      stack.push_back(node);
+      on_stack[node] = true;
+      auto edge = [&](int to) {
+        if (index[to] < 0) {
+          visit(to);
+          low[node] = std::min(low[node], low[to]);
+        } else if (on_stack[to]) {
+          low[node] = std::min(low[node], index[to]);
+        }
+      };
+      if (node < rule_count_) {
+        for (int c = rule_columns_.Next(node, 0); c >= 0;
+             c = rule_columns_.Next(node, c + 1)) {
+          if (c != column_of_rule_[node]) edge(rule_count_ + c);
+        }
+      } else if (rule_of_column_[node - rule_count_] >= 0) {
+        edge(rule_of_column_[node - rule_count_]);
+      }
+
+      if (low[node] != index[node]) return;
+      auto root = std::find(stack.begin(), stack.end(), node);
+      if (stack.end() - root > 1) {
+        for (auto it = root; it != stack.end(); ++it) {
+          if (*it < rule_count_) ambiguous.push_back(*it);
+        }
+      }
+      for (auto it = root; it != stack.end(); ++it) on_stack[*it] = false;
+      stack.erase(root, stack.end());
+    };
+
+    for (int node = 0; node < node_count; ++node) {
+      if (index[node] < 0) visit(node);
+    }
+    std::sort(ambiguous.begin(), ambiguous.end());
+    return ambiguous;
+  }
+
+  // -1 if |rule| isn't matched.
+  int column_of_rule(int rule) const { return column_of_rule_[rule]; }
+
+ private:
+  int rule_count_;
+  int column_count_;
+  BitMatrix rule_columns_;
+  BitMatrix column_rules_;
+  std::vector<int> column_of_rule_;
+  std::vector<int> rule_of_column_;
+};
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -96,85 +545,71 @@ int main(int argc, char** argv) {
   CHECK(std::getline(file, line));
   auto your_ticket = ParseTicket(line);
 
-  // Section 3: other tickets
-  std::vector<Ticket> other_tickets;
-  int64_t error_rate = 0;
-  while (std::getline(file, line)) {
-    if (line.empty() || line == "nearby tickets:") continue;
-    auto ticket = ParseTicket(line);
-    // Part 1 (and needed for Part 2): throw away invalid and count them.
-    if (!CheckValidity(rules, ticket, error_rate)) continue;
-    other_tickets.push_back(ParseTicket(line));
-  }
+  // Section 3: other tickets, ingested in parallel straight into a matrix
+  // and the per-column candidate masks.
+  do {
+    CHECK(std::getline(file, line));
+  } while (line.empty());
+  CHECK_EQ(line, "nearby tickets:");
+  // The rest of the file in one read.
+  std::string text;
+  auto start = file.tellg();
+  file.seekg(0, std::ios::end);
+  text.resize(file.tellg() - start);
+  file.seekg(start);
+  CHECK(file.read(text.data(), text.size()));
+
+  RuleIndex index(rules, FLAGS_max_table_value);
+  const int words = index.words();
+  int value_count = your_ticket.size();
+  TicketMatrix tickets;
+  // Part 1 (and needed for Part 2): throw away invalid and count them.
+  TicketSummary summary =
+      IngestTickets(text, index, value_count, FLAGS_threads, tickets);
+  LOG(INFO) << tickets.rows() << " nearby tickets, " << summary.valid
+            << " valid";
+  const std::vector<uint64_t>& candidates = summary.candidates;
+  int64_t error_rate = summary.error_rate;
 
   LOG(INFO) << "PART 1: " << error_rate;
 
   // Part 2: for every rule, figure out which ticket value (index) matches that
   // rule and print the product of "departure" values on your ticket.
-  int value_count = other_tickets[0].size();
-
-  // Find all values that could fit each rule.
-  absl::flat_hash_map<int, absl::flat_hash_set<int>> rule_to_matching_values;
-  for (int rule_index = 0; rule_index < rules.size(); ++rule_index) {
-    auto rule = rules[rule_index];
-    auto& matching_values = rule_to_matching_values[rule_index];
-    for (int i = 0; i < value_count; ++i) {
-      bool all_match = true;
-      for (const auto& ticket : other_tickets) {
-        if (!RuleMatches(rule, ticket[i])) {
-          all_match = false;
-          break;
-        }
-      }
-      if (all_match) {
-        matching_values.insert(i);
+
+  FieldSolver solver(candidates, words, rules.size(), value_count);
+  int forced = solver.Propagate();
+  int matched = solver.Match();
+  LOG(INFO) << forced << " of " << rules.size()
+            << " fields forced by propagation, " << matched << " matched";
+  if (matched != rules.size() || matched != value_count) {
+    LOG(ERROR) << "Unsatisfiable schema: " << rules.size() << " rules, "
+               << value_count << " columns, at most " << matched
+               << " can be matched";
+    for (int r = 0; r < rules.size(); ++r) {
+      if (solver.column_of_rule(r) < 0) {
+        LOG(ERROR) << "Unmatched rule: " << rules[r].name;
       }
     }
-    CHECK(!rule_to_matching_values[rule_index].empty())
-        << "Can't find match for rule: " << rule.name;
+    return 1;
   }
 
-  // Treat this like simplest sudoku (also how windiff works, sorta): find the
-  // rules that match a single value, remove that value from the list of
-  // allowed matches of all other rules, and repeat until there are no rules
-  // left. Harder sudoku will end up with points where there isn't a clear 1:1
-  // mapping and you have to try different outcomes, but I'm assuming this
-  // puzzle was designed a bit simpler.
-  //
-  // For the curious: Windiff's version of this is: find a line that matches
-  // uniquely and add them to the match set. Walk lines forwards and backwards
-  // from that line and add them to the match set as long as they match. When
-  // complete, anything that remains is an added/removed line.
-  absl::flat_hash_map<int, int> rule_to_matching_value;
-  absl::flat_hash_set<int> matched_rules;
-  while (matched_rules.size() != value_count) {
-    // Find things with a single match.
-    for (auto& [rule_index, matching_values] : rule_to_matching_values) {
-      if (matching_values.empty()) continue;
-      if (matching_values.size() == 1) {
-        // Definite match.
-        auto value = *matching_values.begin();
-        matching_values.clear();
-        auto [_, set_inserted] = matched_rules.insert(value);
-        CHECK(set_inserted) << "Value already matched: " << value;
-        auto [__, map_inserted] =
-            rule_to_matching_value.insert({rule_index, value});
-        CHECK(map_inserted) << "Rule already matched: " << rule_index;
-        for (auto& [_, other_matching_values] : rule_to_matching_values) {
-          other_matching_values.erase(value);
-        }
-      }
-    }
+  // Ambiguity only matters if it touches a field we need.
+  bool departure_ambiguous = false;
+  for (int r : solver.AmbiguousRules()) {
+    LOG(WARNING) << "Ambiguous field: " << rules[r].name;
+    departure_ambiguous |= absl::StartsWith(rules[r].name, "departure");
+  }
+  if (departure_ambiguous) {
+    LOG(ERROR) << "Ambiguous schema: departure fields aren't determined";
+    return 1;
   }
 
-  // If we got here, the previous while loop finished, so the puzzle is set up
-  // as expected :) Part 2 asks us to multiply the values on *our* ticket that
-  // start with the word "departure".
+  // Part 2 asks us to multiply the values on *our* ticket that start with the
+  // word "departure".
   int64_t product = 1;
-  for (auto [rule_index, value_index] : rule_to_matching_value) {
-    auto rule = rules[rule_index];
-    if (absl::StartsWith(rule.name, "departure")) {
-      product *= your_ticket[value_index];
+  for (int r = 0; r < rules.size(); ++r) {
+    if (absl::StartsWith(rules[r].name, "departure")) {
+      product *= your_ticket[solver.column_of_rule(r)];
     }
   }
 
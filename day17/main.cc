@@ -1,6 +1,12 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <execution>
 #include <fstream>
+#include <limits>
+#include <memory>
 #include <numeric>
+#include <thread>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
@@ -10,8 +16,25 @@
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_string(engine, "dense",
+              "How to run the simulation: 'dense' steps a padded grid over "
+              "the bounding box, 'symmetric' only stores one cell per "
+              "mirror/swap orbit of the axes past y, 'sparse' counts "
+              "neighbors of active cubes in a hash map.");
+DEFINE_int32(cycles, 6, "Number of cycles to run.");
+DEFINE_int32(dimensions, 0,
+             "If set, also run in this many dimensions (2-6 for the dense "
+             "engine, 2-10 for the symmetric one, 3 or 4 for the sparse "
+             "one).");
+DEFINE_int32(threads, std::thread::hardware_concurrency(),
+             "Number of threads for the sparse engine; 1 runs it serially.");
+DEFINE_string(cycle_stats, "",
+              "If set, append a CSV line per cycle (engine, dimensions, "
+              "threads, cycle, active cubes, seconds) to this file.");
+
 struct Location {
   int x, y, z, w;
   template <typename H>
@@ -25,32 +48,32 @@ struct Location {
 
 typedef absl::flat_hash_set<Location> World;
 
-void VisitNeighbors(Location location, int dimensions,
-                    std::function<void(Location)> visit) {
+template <typename F>
+void VisitNeighbors(const Location& location, int dimensions, F visit) {
   auto [x, y, z, w] = location;
+  // In 3 dimensions, w is always zero.
+  const int max_l = dimensions == 3 ? 0 : 1;
   for (int i = -1; i <= 1; ++i) {
     for (int j = -1; j <= 1; ++j) {
       for (int k = -1; k <= 1; ++k) {
-        for (int l = -1; l <= 1; ++l) {
-          // In 3 dimensions, w is always zero.
-          if (dimensions == 3 && l != 0) continue;
+        for (int l = -max_l; l <= max_l; ++l) {
           if (i == 0 && j == 0 && k == 0 && l == 0) continue;
-          visit({x + i, y + j, z + k, w + l});
+          visit(Location{x + i, y + j, z + k, w + l});
         }
       }
     }
   }
 }
 
-World RunCycle(World world, int dimensions) {
+World RunCycle(const World& world, int dimensions) {
   absl::flat_hash_map<Location, int> neighbor_count;
-  for (auto cube : world) {
+  for (const auto& cube : world) {
     VisitNeighbors(cube, dimensions,
-                   [&](Location loc) { neighbor_count[loc]++; });
+                   [&](const Location& loc) { neighbor_count[loc]++; });
   }
 
   World new_world;
-  for (auto [location, count] : neighbor_count) {
+  for (const auto& [location, count] : neighbor_count) {
     if (count == 3 || (world.count(location) > 0 && count == 2)) {
       new_world.insert(location);
     }
@@ -58,7 +81,495 @@ World RunCycle(World world, int dimensions) {
   return new_world;
 }
 
+template <typename F>
+void RunThreads(int threads, F work) {
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) workers.emplace_back(work, t);
+  for (auto& worker : workers) worker.join();
+}
+
+// Which thread a cube is given to. Cubes are grouped in 4^4 blocks, so most
+// of a cube's neighbors are counted by the same thread.
+int BlockShard(const Location& l, int threads) {
+  return absl::Hash<Location>()({l.x >> 2, l.y >> 2, l.z >> 2, l.w >> 2}) %
+         threads;
+}
+
+// Which thread merges the counts for a location.
+int MergeShard(const Location& l, int threads) {
+  return absl::Hash<Location>()(l) % threads;
+}
+
+// RunCycle spread over |threads|. Each thread counts the neighbors of its own
+// share of the cubes into per-thread tables, already split by which thread
+// will merge them; then each thread merges one split from every table and
+// decides which of its locations are alive.
+World RunCycleParallel(const World& world, int dimensions, int threads) {
+  std::vector<std::vector<Location>> cubes(threads);
+  for (const auto& cube : world) {
+    cubes[BlockShard(cube, threads)].push_back(cube);
+  }
+
+  // counts[t][s] holds the counts from thread t for merge shard s.
+  std::vector<std::vector<absl::flat_hash_map<Location, int>>> counts(
+      threads, std::vector<absl::flat_hash_map<Location, int>>(threads));
+  RunThreads(threads, [&](int t) {
+    auto& tables = counts[t];
+    for (const auto& cube : cubes[t]) {
+      VisitNeighbors(cube, dimensions, [&](const Location& loc) {
+        tables[MergeShard(loc, threads)][loc]++;
+      });
+    }
+  });
+
+  std::vector<std::vector<Location>> alive(threads);
+  RunThreads(threads, [&](int s) {
+    auto& merged = counts[0][s];
+    for (int t = 1; t < threads; ++t) {
+      for (const auto& [location, count] : counts[t][s]) {
+        merged[location] += count;
+      }
+    }
+    for (const auto& [location, count] : merged) {
+      if (count == 3 || (world.count(location) > 0 && count == 2)) {
+        alive[s].push_back(location);
+      }
+    }
+  });
+
+  World new_world;
+  size_t total = 0;
+  for (const auto& shard : alive) total += shard.size();
+  new_world.reserve(total);
+  for (const auto& shard : alive) new_world.insert(shard.begin(), shard.end());
+  return new_world;
+}
+
+// Runs |cycles| calls of |step|, which returns the number of active cubes
+// afterwards, and appends each cycle's timing to |stats| if it's not null.
+template <typename F>
+int64_t RunCycles(int dimensions, int cycles, int threads, std::ostream* stats,
+                  F step) {
+  int64_t active = 0;
+  for (int i = 0; i < cycles; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    active = step();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (stats != nullptr) {
+      *stats << FLAGS_engine << "," << dimensions << "," << threads << ","
+             << i + 1 << "," << active << "," << elapsed.count() << "\n";
+    }
+  }
+  if (stats != nullptr) stats->flush();
+  return active;
+}
+
+// Runs the simulation on a dense D-dimensional grid of bytes that covers the
+// bounding box of the active cubes. Axis 0 is x and is contiguous in memory,
+// axis 1 is y and the rest start out flat, since the input is a 2D slice.
+//
+// Each cycle pads the box by a cell on every side (nothing further out can
+// come alive), sums every 3^D box one axis at a time, then trims the result
+// back to its bounding box. A box sum along an axis with stride s is just
+// three shifted adds over contiguous memory, so every pass vectorizes.
+template <int D>
+class DenseWorld {
+  static_assert(D >= 2 && D <= 6, "3^D box sums must fit in uint16_t");
+
+ public:
+  typedef std::array<int, D> Coords;
+
+  explicit DenseWorld(const World& slice) {
+    int min_x = std::numeric_limits<int>::max(), min_y = min_x;
+    int max_x = std::numeric_limits<int>::min(), max_y = max_x;
+    for (const auto& cube : slice) {
+      CHECK(cube.z == 0 && cube.w == 0) << "Expected a 2D starting slice";
+      min_x = std::min(min_x, cube.x);
+      max_x = std::max(max_x, cube.x);
+      min_y = std::min(min_y, cube.y);
+      max_y = std::max(max_y, cube.y);
+    }
+    extent_.fill(slice.empty() ? 0 : 1);
+    if (!slice.empty()) {
+      extent_[0] = max_x - min_x + 1;
+      extent_[1] = max_y - min_y + 1;
+    }
+    cells_.assign(Size(extent_), 0);
+    for (const auto& cube : slice) {
+      cells_[cube.x - min_x + (cube.y - min_y) * extent_[0]] = 1;
+    }
+    active_ = slice.size();
+  }
+
+  int64_t active() const { return active_; }
+
+  void Step() {
+    Coords padded;
+    for (int a = 0; a < D; ++a) padded[a] = extent_[a] + 2;
+    const Coords strides = Strides(padded);
+    const int64_t size = Size(padded);
+
+    alive_.assign(size, 0);
+    ForEachCell(extent_, [&](const Coords& c, int64_t i) {
+      if (!cells_[i]) return;
+      int64_t padded_index = 0;
+      for (int a = 0; a < D; ++a) padded_index += (c[a] + 1) * strides[a];
+      alive_[padded_index] = 1;
+    });
+
+    sums_.assign(alive_.begin(), alive_.end());
+    scratch_.resize(size);
+    for (int a = 0; a < D; ++a) {
+      BoxSum(sums_.data(), scratch_.data(), size, strides[a],
+             int64_t{strides[a]} * padded[a]);
+      sums_.swap(scratch_);
+    }
+
+    // The box includes the cube itself: a live cube stays alive with 2 or 3
+    // neighbors (sum 3 or 4) and a dead one comes alive with 3 (sum 3).
+    for (int64_t i = 0; i < size; ++i) {
+      alive_[i] = (sums_[i] == 3) | (alive_[i] & (sums_[i] == 4));
+    }
+    Trim(padded);
+  }
+
+ private:
+  static int64_t Size(const Coords& extent) {
+    int64_t size = 1;
+    for (int e : extent) size *= e;
+    return size;
+  }
+
+  static Coords Strides(const Coords& extent) {
+    Coords strides;
+    int stride = 1;
+    for (int a = 0; a < D; ++a) {
+      strides[a] = stride;
+      stride *= extent[a];
+    }
+    return strides;
+  }
+
+  // Calls f(coords, index) for every cell, in memory order.
+  template <typename F>
+  static void ForEachCell(const Coords& extent, F f) {
+    const int64_t size = Size(extent);
+    Coords c{};
+    for (int64_t i = 0; i < size; ++i) {
+      f(c, i);
+      for (int a = 0; a < D && ++c[a] == extent[a]; ++a) c[a] = 0;
+    }
+  }
+
+  // out = in + in shifted by +/-stride along one axis, without crossing
+  // the edges of each block (the span of that axis).
+  static void BoxSum(const uint16_t* in, uint16_t* out, int64_t size,
+                     int64_t stride, int64_t block) {
+    for (int64_t start = 0; start < size; start += block) {
+      const uint16_t* from = in + start;
+      uint16_t* to = out + start;
+      for (int64_t i = 0; i < block; ++i) to[i] = from[i];
+      for (int64_t i = stride; i < block; ++i) to[i] += from[i - stride];
+      for (int64_t i = 0; i + stride < block; ++i) to[i] += from[i + stride];
+    }
+  }
+
+  // Shrinks alive_ (of extent |padded|) to the bounding box of its live
+  // cells and stores it as the new cells_.
+  void Trim(const Coords& padded) {
+    Coords low, high;
+    low.fill(std::numeric_limits<int>::max());
+    high.fill(-1);
+    active_ = 0;
+    ForEachCell(padded, [&](const Coords& c, int64_t i) {
+      if (!alive_[i]) return;
+      ++active_;
+      for (int a = 0; a < D; ++a) {
+        low[a] = std::min(low[a], c[a]);
+        high[a] = std::max(high[a], c[a]);
+      }
+    });
+    if (active_ == 0) {
+      extent_.fill(0);
+      cells_.clear();
+      return;
+    }
+
+    for (int a = 0; a < D; ++a) extent_[a] = high[a] - low[a] + 1;
+    const Coords strides = Strides(padded);
+    cells_.resize(Size(extent_));
+    // Copy whole rows along the contiguous axis.
+    Coords rows = extent_;
+    rows[0] = 1;
+    int64_t out = 0;
+    ForEachCell(rows, [&](const Coords& c, int64_t) {
+      int64_t in = low[0];
+      for (int a = 1; a < D; ++a) in += (c[a] + low[a]) * strides[a];
+      std::copy_n(&alive_[in], extent_[0], &cells_[out]);
+      out += extent_[0];
+    });
+  }
+
+  Coords extent_;
+  std::vector<uint8_t> cells_;
+  int64_t active_ = 0;
+
+  // Per-step scratch, kept to avoid reallocating every cycle.
+  std::vector<uint8_t> alive_;
+  std::vector<uint16_t> sums_;
+  std::vector<uint16_t> scratch_;
+};
+
+template <int D>
+int64_t RunDense(const World& start, int cycles, std::ostream* stats) {
+  DenseWorld<D> world(start);
+  return RunCycles(D, cycles, 1, stats, [&]() {
+    world.Step();
+    return world.active();
+  });
+}
+
+int64_t RunDense(const World& start, int dimensions, int cycles,
+                 std::ostream* stats) {
+  switch (dimensions) {
+    case 2:
+      return RunDense<2>(start, cycles, stats);
+    case 3:
+      return RunDense<3>(start, cycles, stats);
+    case 4:
+      return RunDense<4>(start, cycles, stats);
+    case 5:
+      return RunDense<5>(start, cycles, stats);
+    case 6:
+      return RunDense<6>(start, cycles, stats);
+  }
+  LOG(FATAL) << "Unsupported dimensions: " << dimensions;
+  return 0;
+}
+
+// Runs the simulation on just the canonical 0 <= z <= w <= ... part of the
+// grid. The input is a 2D slice, so the state stays symmetric under flipping
+// the sign of any axis past y and under swapping any two of them, and one
+// cell per orbit is enough: 2^(D-2) * (D-2)! fewer for cells off the mirror
+// planes.
+//
+// Cells are kept as one xy plane per canonical tuple of the extra
+// coordinates. The neighbors of a plane come from the 3^(D-2) tuples next to
+// it, which fold back onto a few canonical tuples, so its box sum is the sum
+// of their 3x3 box sums weighted by how many neighbors fold onto each.
+// Tuples are ordered by their largest coordinate, which can only have grown
+// by one per cycle, so each cycle only touches a prefix of the planes.
+class SymmetricWorld {
+ public:
+  // The planes are sized up front for |cycles| cycles.
+  SymmetricWorld(const World& slice, int dimensions, int cycles)
+      : extra_(dimensions - 2), cycles_(cycles) {
+    CHECK_GE(dimensions, 2);
+    CHECK_LE(dimensions, 10) << "3^D box sums must fit in uint16_t";
+    int max_x = 0, max_y = 0;
+    for (const auto& cube : slice) {
+      CHECK(cube.z == 0 && cube.w == 0) << "Expected a 2D starting slice";
+      CHECK(cube.x >= 0 && cube.y >= 0);
+      max_x = std::max(max_x, cube.x);
+      max_y = std::max(max_y, cube.y);
+    }
+    // A margin wider than the cubes can spread keeps the edges of each
+    // plane dead, so box sums can run over the flat plane and ignore rows.
+    const int margin = cycles + 1;
+    width_ = max_x + 1 + 2 * margin;
+    plane_size_ = int64_t{width_} * (max_y + 1 + 2 * margin);
+
+    std::vector<int> tuple;
+    AddTuples(tuple, 0);
+    std::stable_sort(tuples_.begin(), tuples_.end(),
+                     [](const std::vector<int>& a, const std::vector<int>& b) {
+                       return Max(a) < Max(b);
+                     });
+    absl::flat_hash_map<std::vector<int>, int> index;
+    for (int t = 0; t < tuples_.size(); ++t) {
+      index[tuples_[t]] = t;
+      multiplicity_.push_back(Multiplicity(tuples_[t]));
+    }
+    tuples_within_.assign(cycles + 1, 0);
+    for (const auto& t : tuples_) {
+      for (int r = Max(t); r <= cycles; ++r) ++tuples_within_[r];
+    }
+
+    // Fold every neighboring tuple (including the tuple itself, whose box
+    // sum counts the cube itself) back to its canonical form.
+    sources_.resize(tuples_.size());
+    std::vector<int> offset(extra_, -1), neighbor(extra_);
+    for (int t = 0; t < tuples_.size(); ++t) {
+      absl::flat_hash_map<int, int> weights;
+      std::fill(offset.begin(), offset.end(), -1);
+      while (true) {
+        for (int a = 0; a < extra_; ++a) {
+          neighbor[a] = std::abs(tuples_[t][a] + offset[a]);
+        }
+        std::sort(neighbor.begin(), neighbor.end());
+        auto it = index.find(neighbor);
+        if (it != index.end()) ++weights[it->second];
+        int a = 0;
+        for (; a < extra_ && ++offset[a] == 2; ++a) offset[a] = -1;
+        if (a == extra_) break;
+      }
+      for (auto [source, weight] : weights) {
+        sources_[t].push_back({source, weight});
+      }
+      std::sort(sources_[t].begin(), sources_[t].end());
+    }
+
+    cells_.assign(tuples_.size() * plane_size_, 0);
+    next_.assign(cells_.size(), 0);
+    for (const auto& cube : slice) {
+      cells_[(cube.y + margin) * width_ + cube.x + margin] = 1;
+    }
+  }
+
+  // Cubes in the whole grid, not just the canonical part.
+  int64_t active() const {
+    int64_t active = 0;
+    for (int t = 0; t < tuples_within_[steps_]; ++t) {
+      const uint8_t* plane = &cells_[t * plane_size_];
+      active += multiplicity_[t] * std::count(plane, plane + plane_size_, 1);
+    }
+    return active;
+  }
+
+  void Step() {
+    CHECK_LT(steps_, cycles_) << "Planes were sized for " << cycles_;
+    const int live = tuples_within_[steps_];
+    const int next_live = tuples_within_[steps_ + 1];
+
+    box_.resize(live * plane_size_);
+    row_.resize(plane_size_);
+    for (int t = 0; t < live; ++t) {
+      BoxSum(&cells_[t * plane_size_], &box_[t * plane_size_]);
+    }
+
+    sum_.resize(plane_size_);
+    for (int t = 0; t < next_live; ++t) {
+      std::fill(sum_.begin(), sum_.end(), 0);
+      for (auto [source, weight] : sources_[t]) {
+        if (source >= live) break;
+        const uint16_t* box = &box_[source * plane_size_];
+        for (int64_t i = 0; i < plane_size_; ++i) sum_[i] += weight * box[i];
+      }
+      // As in DenseWorld, the sum includes the cube itself.
+      const uint8_t* alive = &cells_[t * plane_size_];
+      uint8_t* next = &next_[t * plane_size_];
+      for (int64_t i = 0; i < plane_size_; ++i) {
+        next[i] = (sum_[i] == 3) | (alive[i] & (sum_[i] == 4));
+      }
+    }
+    cells_.swap(next_);
+    ++steps_;
+  }
+
+ private:
+  static int Max(const std::vector<int>& tuple) {
+    return tuple.empty() ? 0 : tuple.back();
+  }
+
+  // Appends every non-decreasing tuple of extra_ coordinates in
+  // [0, cycles_] that starts with |tuple|, with no element below |min|.
+  void AddTuples(std::vector<int>& tuple, int min) {
+    if (tuple.size() == extra_) {
+      tuples_.push_back(tuple);
+      return;
+    }
+    for (int v = min; v <= cycles_; ++v) {
+      tuple.push_back(v);
+      AddTuples(tuple, v);
+      tuple.pop_back();
+    }
+  }
+
+  // How many cells of the full grid |tuple| stands for: its distinct
+  // orderings, times a sign for every non-zero coordinate.
+  static int64_t Multiplicity(const std::vector<int>& tuple) {
+    int64_t count = 1;
+    int run = 0;
+    for (int a = 0; a < tuple.size(); ++a) {
+      run = a > 0 && tuple[a] == tuple[a - 1] ? run + 1 : 1;
+      count = count * (a + 1) / run;
+      if (tuple[a] != 0) count *= 2;
+    }
+    return count;
+  }
+
+  // 3x3 box sums of a plane, one axis at a time as in DenseWorld.
+  void BoxSum(const uint8_t* plane, uint16_t* box) {
+    const int64_t size = plane_size_;
+    for (int64_t i = 0; i < size; ++i) row_[i] = plane[i];
+    for (int64_t i = 1; i < size; ++i) row_[i] += plane[i - 1];
+    for (int64_t i = 0; i + 1 < size; ++i) row_[i] += plane[i + 1];
+    for (int64_t i = 0; i < size; ++i) box[i] = row_[i];
+    for (int64_t i = width_; i < size; ++i) box[i] += row_[i - width_];
+    for (int64_t i = 0; i + width_ < size; ++i) box[i] += row_[i + width_];
+  }
+
+  int extra_;
+  int cycles_;
+  int width_;
+  int64_t plane_size_;
+  int steps_ = 0;
+
+  // Canonical tuples of the coordinates past y, by largest coordinate.
+  std::vector<std::vector<int>> tuples_;
+  std::vector<int64_t> multiplicity_;
+  // tuples_within_[r] is the number of tuples whose coordinates are <= r.
+  std::vector<int> tuples_within_;
+  // For each tuple, (canonical tuple, how many neighbors fold onto it).
+  std::vector<std::vector<std::pair<int, int>>> sources_;
+
+  std::vector<uint8_t> cells_;
+  std::vector<uint8_t> next_;
+  std::vector<uint16_t> box_;
+  std::vector<uint16_t> row_;
+  std::vector<uint16_t> sum_;
+};
+
+int64_t RunSymmetric(const World& start, int dimensions, int cycles,
+                     std::ostream* stats) {
+  SymmetricWorld world(start, dimensions, cycles);
+  return RunCycles(dimensions, cycles, 1, stats, [&]() {
+    world.Step();
+    return world.active();
+  });
+}
+
+int64_t RunSparse(const World& start, int dimensions, int cycles,
+                  int threads, std::ostream* stats) {
+  CHECK(dimensions == 3 || dimensions == 4)
+      << "Sparse engine supports 3 or 4 dimensions";
+  CHECK_GE(threads, 1);
+  World world = start;
+  return RunCycles(dimensions, cycles, threads, stats, [&]() {
+    world = threads == 1 ? RunCycle(world, dimensions)
+                         : RunCycleParallel(world, dimensions, threads);
+    return world.size();
+  });
+}
+
+int64_t Run(const World& start, int dimensions, int cycles,
+            std::ostream* stats) {
+  if (FLAGS_engine == "dense") {
+    return RunDense(start, dimensions, cycles, stats);
+  }
+  if (FLAGS_engine == "symmetric") {
+    return RunSymmetric(start, dimensions, cycles, stats);
+  }
+  if (FLAGS_engine == "sparse") {
+    return RunSparse(start, dimensions, cycles, FLAGS_threads, stats);
+  }
+  LOG(FATAL) << "Unknown engine: " << FLAGS_engine;
+  return 0;
+}
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -78,17 +589,23 @@ int main(int argc, char** argv) {
     ++y;
   }
 
-  // Part 1: run the simulation 6 times in 3 dimensions.
-  World world = starting_world;
-  for (int i = 0; i < 6; ++i) {
-    world = RunCycle(world, 3);
+  std::unique_ptr<std::ofstream> stats;
+  if (!FLAGS_cycle_stats.empty()) {
+    stats = std::make_unique<std::ofstream>(FLAGS_cycle_stats, std::ios::app);
+    CHECK(*stats) << FLAGS_cycle_stats;
   }
-  LOG(INFO) << "PART 1: " << world.size();
+
+  // Part 1: run the simulation 6 times in 3 dimensions.
+  LOG(INFO) << "PART 1: "
+            << Run(starting_world, 3, FLAGS_cycles, stats.get());
   // Part 2: run the simulation 6 times in 4 dimensions.
-  world = starting_world;
-  for (int i = 0; i < 6; ++i) {
-    world = RunCycle(world, 4);
+  LOG(INFO) << "PART 2: "
+            << Run(starting_world, 4, FLAGS_cycles, stats.get());
+
+  if (FLAGS_dimensions != 0) {
+    LOG(INFO) << FLAGS_dimensions << "D: "
+              << Run(starting_world, FLAGS_dimensions, FLAGS_cycles,
+                     stats.get());
   }
-  LOG(INFO) << "PART 2: " << world.size();
   return 0;
 }
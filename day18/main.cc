@@ -1,9 +1,14 @@
+#include <array>
 #include <execution>
 #include <fstream>
+#include <list>
 #include <numeric>
+#include <stack>
+#include <thread>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/numeric/int128.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
@@ -11,8 +16,20 @@
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
 #include "absl/types/variant.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_string(engine, "bytecode",
+              "How to evaluate: 'bytecode' tokenizes every line once and "
+              "compiles postfix bytecode per precedence policy, 'bytes' does "
+              "precedence climbing straight over each line, 'postfix' "
+              "tokenizes and converts to postfix per policy.");
+DEFINE_int32(threads, std::thread::hardware_concurrency(),
+             "Number of threads to evaluate bytecode with.");
+DEFINE_bool(checked_int128, false,
+            "Evaluate bytecode in 128 bits, failing on overflow instead of "
+            "wrapping around like the int64_t engines.");
+
 enum TokenType {
   kNumber,
   kOperator,
@@ -35,8 +52,8 @@ struct Token {
 
 typedef std::list<Token> Expression;
 
-Expression ParseExpression(std::string line) {
-  Expression tokens;
+// Appends the tokens of |line| to |tokens|.
+void Tokenize(absl::string_view line, std::vector<Token>& tokens) {
   for (int i = 0; i < line.size(); ++i) {
     char c = line[i];
     if (c == ' ') continue;
@@ -50,8 +67,9 @@ Expression ParseExpression(std::string line) {
       tokens.push_back({kOperator, 0, kMultiply});
     } else {
       // It's a number! Read it.
+      CHECK(c >= '0' && c <= '9') << "Unexpected '" << c << "' in: " << line;
       int64_t number = c - '0';
-      while (line[i + 1] >= '0' && line[i + 1] <= '9') {
+      while (i + 1 < line.size() && line[i + 1] >= '0' && line[i + 1] <= '9') {
         ++i;
         number *= 10;
         number += line[i] - '0';
@@ -59,7 +77,12 @@ Expression ParseExpression(std::string line) {
       tokens.push_back({kNumber, number});
     }
   }
-  return tokens;
+}
+
+Expression ParseExpression(const std::string& line) {
+  std::vector<Token> tokens;
+  Tokenize(line, tokens);
+  return Expression(tokens.begin(), tokens.end());
 }
 
 typedef absl::flat_hash_map<Operator, int> PrecedenceMap;
@@ -107,9 +130,9 @@ Expression InfixToPostfix(const Expression& expression,
   return output;
 }
 
-std::string PostfixToString(Expression expression) {
+std::string PostfixToString(const Expression& expression) {
   std::string s;
-  for (auto token : expression) {
+  for (const auto& token : expression) {
     switch (token.type) {
       case kNumber:
         s = absl::StrCat(s, " ", token.value);
@@ -126,7 +149,7 @@ std::string PostfixToString(Expression expression) {
 }
 
 int64_t EvaluatePostfix(Expression expression) {
-  LOG(INFO) << PostfixToString(expression);
+  VLOG(1) << PostfixToString(expression);
   std::stack<int64_t> values;
   while (!expression.empty()) {
     auto token = expression.front();
@@ -154,18 +177,277 @@ int64_t EvaluatePostfix(Expression expression) {
   return values.top();
 }
 
-int64_t EvaluateAllWithPrecedence(std::list<Expression> expressions,
-                                  PrecedenceMap precedence) {
+int64_t EvaluateAllWithPrecedence(const std::list<Expression>& expressions,
+                                  const PrecedenceMap& precedence) {
   int64_t total = 0;
-  for (auto expression : expressions) {
+  for (const auto& expression : expressions) {
     auto value = EvaluatePostfix(InfixToPostfix(expression, precedence));
-    LOG(INFO) << value;
+    VLOG(1) << value;
     total += value;
   }
   return total;
 }
 
+char OperatorByte(Operator op) { return op == kAdd ? '+' : '*'; }
+
+// A PrecedenceMap resolved to an array indexed by the operator's byte, so
+// EvaluateBytes can look precedence up straight from the input. Zero means
+// the byte isn't an operator.
+class PrecedenceTable {
+ public:
+  explicit PrecedenceTable(const PrecedenceMap& map) {
+    table_.fill(0);
+    for (const auto& [op, precedence] : map) {
+      CHECK(precedence > 0 && precedence < 256) << precedence;
+      table_[OperatorByte(op)] = precedence;
+    }
+  }
+
+  int operator[](char c) const { return table_[static_cast<uint8_t>(c)]; }
+
+ private:
+  std::array<uint8_t, 256> table_;
+};
+
+// Precedence climbing straight over the bytes of |line|, without tokenizing
+// or allocating. Operands and pending operators live on small fixed stacks,
+// with '(' on the operator stack as a barrier. An operator first applies
+// every pending operator that binds at least as tightly (everything is
+// left-associative); ')' applies everything back to its '(', and the end of
+// the line everything that's left.
+int64_t EvaluateBytes(absl::string_view line,
+                      const PrecedenceTable& precedence) {
+  constexpr int kMaxStack = 64;
+  int64_t values[kMaxStack];
+  char ops[kMaxStack];
+  int value_count = 0, op_count = 0;
+
+  auto reduce = [&]() {
+    CHECK_GE(value_count, 2) << "Missing operand: " << line;
+    int64_t right = values[--value_count];
+    int64_t& left = values[value_count - 1];
+    left = ops[--op_count] == '+' ? left + right : left * right;
+  };
+
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (c == ' ') continue;
+    if (c >= '0' && c <= '9') {
+      int64_t number = c - '0';
+      while (i + 1 < line.size() && line[i + 1] >= '0' && line[i + 1] <= '9') {
+        number = number * 10 + (line[++i] - '0');
+      }
+      CHECK_LT(value_count, kMaxStack) << "Nested too deeply: " << line;
+      values[value_count++] = number;
+    } else if (c == '(') {
+      CHECK_LT(op_count, kMaxStack) << "Nested too deeply: " << line;
+      ops[op_count++] = c;
+    } else if (c == ')') {
+      while (op_count > 0 && ops[op_count - 1] != '(') reduce();
+      CHECK_GT(op_count, 0) << "Misaligned parens: " << line;
+      --op_count;
+    } else {
+      int p = precedence[c];
+      CHECK_GT(p, 0) << "Unexpected '" << c << "' in: " << line;
+      while (op_count > 0 && ops[op_count - 1] != '(' &&
+             precedence[ops[op_count - 1]] >= p) {
+        reduce();
+      }
+      CHECK_LT(op_count, kMaxStack) << "Nested too deeply: " << line;
+      ops[op_count++] = c;
+    }
+  }
+  while (op_count > 0) {
+    CHECK_NE(ops[op_count - 1], '(') << "Misaligned parens: " << line;
+    reduce();
+  }
+  CHECK_EQ(value_count, 1) << "Malformed expression: " << line;
+  return values[0];
+}
+
+int64_t EvaluateAllBytes(const std::vector<std::string>& lines,
+                         const PrecedenceMap& precedence) {
+  PrecedenceTable table(precedence);
+  int64_t total = 0;
+  for (const auto& line : lines) {
+    total += EvaluateBytes(line, table);
+  }
+  return total;
+}
+
+typedef __int128 int128;
+
+// Every expression tokenized once into one flat array, shared by every
+// precedence policy: expression i is tokens[starts[i], starts[i + 1]).
+struct Corpus {
+  std::vector<Token> tokens;
+  std::vector<size_t> starts = {0};
+
+  size_t size() const { return starts.size() - 1; }
+};
+
+Corpus Tokenize(const std::vector<std::string>& lines) {
+  Corpus corpus;
+  for (const auto& line : lines) {
+    Tokenize(line, corpus.tokens);
+    corpus.starts.push_back(corpus.tokens.size());
+  }
+  return corpus;
+}
+
+enum class Opcode : uint8_t {
+  kPush,
+  kAdd,
+  kMultiply,
+};
+
+struct Instruction {
+  Opcode opcode;
+  // The operand of kPush.
+  int64_t value = 0;
+};
+
+// A Corpus compiled to postfix for one precedence policy, laid out the same
+// way: expression i is code[starts[i], starts[i + 1]).
+struct Bytecode {
+  std::vector<Instruction> code;
+  std::vector<size_t> starts = {0};
+  // The deepest the value stack gets in any expression.
+  int max_depth = 0;
+
+  size_t size() const { return starts.size() - 1; }
+};
+
+// Shunting-yard, as in InfixToPostfix, over the whole corpus at once.
+Bytecode Compile(const Corpus& corpus, const PrecedenceMap& precedence) {
+  const PrecedenceTable table(precedence);
+  Bytecode bytecode;
+  bytecode.code.reserve(corpus.tokens.size());
+  std::vector<Token> operators;
+  int depth = 0;
+
+  auto emit = [&](Operator op) {
+    CHECK_GE(depth, 2) << "Missing operand";
+    --depth;
+    bytecode.code.push_back(
+        {op == kAdd ? Opcode::kAdd : Opcode::kMultiply});
+  };
+
+  for (size_t e = 0; e < corpus.size(); ++e) {
+    for (size_t i = corpus.starts[e]; i < corpus.starts[e + 1]; ++i) {
+      const Token& token = corpus.tokens[i];
+      switch (token.type) {
+        case kNumber:
+          bytecode.code.push_back({Opcode::kPush, token.value});
+          bytecode.max_depth = std::max(bytecode.max_depth, ++depth);
+          break;
+        case kOperator:
+          while (!operators.empty() && operators.back().type != kOpenParen &&
+                 table[OperatorByte(operators.back().op)] >=
+                     table[OperatorByte(token.op)]) {
+            emit(operators.back().op);
+            operators.pop_back();
+          }
+          operators.push_back(token);
+          break;
+        case kOpenParen:
+          operators.push_back(token);
+          break;
+        case kCloseParen:
+          while (!operators.empty() && operators.back().type != kOpenParen) {
+            emit(operators.back().op);
+            operators.pop_back();
+          }
+          CHECK(!operators.empty()) << "Misaligned parens in expression " << e;
+          operators.pop_back();
+          break;
+      }
+    }
+    while (!operators.empty()) {
+      CHECK(operators.back().type != kOpenParen)
+          << "Misaligned parens in expression " << e;
+      emit(operators.back().op);
+      operators.pop_back();
+    }
+    CHECK_EQ(depth, 1) << "Malformed expression " << e;
+    depth = 0;
+    bytecode.starts.push_back(bytecode.code.size());
+  }
+  return bytecode;
+}
+
+// a += b, failing instead of overflowing if kChecked.
+template <bool kChecked, typename IntT>
+void Add(IntT& a, IntT b) {
+  if constexpr (kChecked) {
+    CHECK(!__builtin_add_overflow(a, b, &a)) << "Overflow in addition";
+  } else {
+    a += b;
+  }
+}
+
+// a *= b, failing instead of overflowing if kChecked.
+template <bool kChecked, typename IntT>
+void Multiply(IntT& a, IntT b) {
+  if constexpr (kChecked) {
+    CHECK(!__builtin_mul_overflow(a, b, &a)) << "Overflow in multiplication";
+  } else {
+    a *= b;
+  }
+}
+
+// Runs one expression's bytecode on |stack|, which must hold max_depth.
+template <typename IntT, bool kChecked>
+IntT Run(const Instruction* begin, const Instruction* end, IntT* stack) {
+  int depth = 0;
+  for (const Instruction* in = begin; in != end; ++in) {
+    switch (in->opcode) {
+      case Opcode::kPush:
+        stack[depth++] = in->value;
+        break;
+      case Opcode::kAdd:
+        --depth;
+        Add<kChecked>(stack[depth - 1], stack[depth]);
+        break;
+      case Opcode::kMultiply:
+        --depth;
+        Multiply<kChecked>(stack[depth - 1], stack[depth]);
+        break;
+    }
+  }
+  return stack[0];
+}
+
+// Sums every expression in |bytecode|, split into contiguous ranges across
+// |threads|, each summing its own range before the partial sums are added.
+template <typename IntT, bool kChecked>
+IntT EvaluateAll(const Bytecode& bytecode, int threads) {
+  const size_t size = bytecode.size();
+  threads = std::max<int64_t>(1, std::min<int64_t>(threads, size));
+  std::vector<IntT> partial(threads, 0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      std::vector<IntT> stack(bytecode.max_depth);
+      IntT sum = 0;
+      for (size_t e = size * t / threads; e < size * (t + 1) / threads; ++e) {
+        const Instruction* code = bytecode.code.data();
+        Add<kChecked>(sum, Run<IntT, kChecked>(code + bytecode.starts[e],
+                                                code + bytecode.starts[e + 1],
+                                                stack.data()));
+      }
+      partial[t] = sum;
+    });
+  }
+  for (auto& worker : workers) worker.join();
+
+  IntT total = 0;
+  for (IntT sum : partial) Add<kChecked>(total, sum);
+  return total;
+}
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -174,21 +456,44 @@ int main(int argc, char** argv) {
   CHECK(file);
 
   std::string line;
-  std::list<Expression> expressions;
+  std::vector<std::string> lines;
   while (std::getline(file, line)) {
-    expressions.push_back(ParseExpression(line));
+    lines.push_back(line);
   }
 
+  // Tokenized once for every policy.
+  Corpus corpus;
+  if (FLAGS_engine == "bytecode") corpus = Tokenize(lines);
+
+  auto evaluate_all = [&](const PrecedenceMap& precedence) -> absl::int128 {
+    if (FLAGS_engine == "bytecode") {
+      Bytecode bytecode = Compile(corpus, precedence);
+      if (FLAGS_checked_int128) {
+        return EvaluateAll<int128, true>(bytecode, FLAGS_threads);
+      }
+      return EvaluateAll<int64_t, false>(bytecode, FLAGS_threads);
+    }
+    CHECK(!FLAGS_checked_int128)
+        << "--checked_int128 needs the bytecode engine";
+    if (FLAGS_engine == "bytes") return EvaluateAllBytes(lines, precedence);
+    CHECK_EQ(FLAGS_engine, "postfix") << "Unknown engine";
+    std::list<Expression> expressions;
+    for (const auto& text : lines) {
+      expressions.push_back(ParseExpression(text));
+    }
+    return EvaluateAllWithPrecedence(expressions, precedence);
+  };
+
   {
     // For Part 1: evalute each with equal precedence.
     PrecedenceMap precedence = {{kAdd, 1}, {kMultiply, 1}};
-    int64_t total = EvaluateAllWithPrecedence(expressions, precedence);
+    absl::int128 total = evaluate_all(precedence);
     LOG(INFO) << "PART 1: " << total;
   }
   {
     // For Part 2: evalute with Add at higher precedence.
     PrecedenceMap precedence = {{kAdd, 2}, {kMultiply, 1}};
-    int64_t total = EvaluateAllWithPrecedence(expressions, precedence);
+    absl::int128 total = evaluate_all(precedence);
     LOG(INFO) << "PART 2: " << total;
   }
   return 0;
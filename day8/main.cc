@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 
 #include "absl/container/flat_hash_map.h"
@@ -7,8 +8,15 @@
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_bool(trace, false,
+            "Trace program execution and log a hot-spot report for each run.");
+DEFINE_int32(trace_history, 64,
+             "Number of most recent jumps kept in the trace ring buffer.");
+DEFINE_int32(trace_top, 10, "Number of entries in each hot-spot list.");
+
 enum Opcode { kNop, kAcc, kJmp };
 
 struct Op {
@@ -33,19 +41,115 @@ Op ParseOp(std::string line) {
 
 typedef std::vector<Op> Code;
 
+// Tracer that records nothing. Every hook is an empty inline function, so a
+// run with this tracer compiles down to the plain interpreter loop.
+struct NullTracer {
+  void OnInstruction(int pc) {}
+  void OnJump(int from, int to) {}
+  void OnLoop(int pc) {}
+};
+
+// Records per-instruction hit counts, jump edge frequencies and the pc where
+// the program started looping. The most recent jumps are also kept in a fixed
+// size ring buffer so the path into the loop can be reported.
+class ExecutionTracer {
+ public:
+  ExecutionTracer(const Code& code, int history)
+      : code_(code), hits_(code.size(), 0), history_(std::max(history, 1)) {}
+
+  void OnInstruction(int pc) { ++hits_[pc]; }
+
+  void OnJump(int from, int to) {
+    ++edges_[{from, to}];
+    history_[jump_count_ % history_.size()] = {from, to};
+    ++jump_count_;
+  }
+
+  void OnLoop(int pc) { loop_entry_ = pc; }
+
+  // Logs the hottest instructions and jump edges, the loop entry point (if
+  // any) and the last jumps taken.
+  void Report(int top) const {
+    std::vector<int> pcs;
+    for (int pc = 0; pc < hits_.size(); ++pc) {
+      if (hits_[pc] > 0) pcs.push_back(pc);
+    }
+    std::stable_sort(pcs.begin(), pcs.end(),
+                     [&](int a, int b) { return hits_[a] > hits_[b]; });
+    if (pcs.size() > top) pcs.resize(top);
+
+    std::vector<std::pair<std::pair<int, int>, int64_t>> edges(edges_.begin(),
+                                                               edges_.end());
+    std::sort(edges.begin(), edges.end(), [](const auto& a, const auto& b) {
+      if (a.second != b.second) return a.second > b.second;
+      return a.first < b.first;
+    });
+    if (edges.size() > top) edges.resize(top);
+
+    LOG(INFO) << "TRACE: " << pcs.size() << " hottest instructions:";
+    for (int pc : pcs) {
+      LOG(INFO) << absl::Substitute("  pc $0 ($1 $2): $3 hits", pc,
+                                    OpcodeName(code_[pc].opcode),
+                                    code_[pc].operand, hits_[pc]);
+    }
+    LOG(INFO) << "TRACE: " << edges.size() << " hottest jump edges:";
+    for (const auto& [edge, count] : edges) {
+      LOG(INFO) << absl::Substitute("  $0 -> $1: $2 times", edge.first,
+                                    edge.second, count);
+    }
+    if (loop_entry_ >= 0) {
+      LOG(INFO) << "TRACE: loop entered at pc " << loop_entry_;
+    } else {
+      LOG(INFO) << "TRACE: no loop";
+    }
+    int64_t recent = std::min<int64_t>(jump_count_, history_.size());
+    LOG(INFO) << "TRACE: last " << recent << " of " << jump_count_
+              << " jumps:";
+    for (int64_t i = jump_count_ - recent; i < jump_count_; ++i) {
+      auto [from, to] = history_[i % history_.size()];
+      LOG(INFO) << absl::Substitute("  $0 -> $1", from, to);
+    }
+  }
+
+ private:
+  static const char* OpcodeName(Opcode opcode) {
+    switch (opcode) {
+      case kNop:
+        return "nop";
+      case kAcc:
+        return "acc";
+      case kJmp:
+        return "jmp";
+    }
+    return "???";
+  }
+
+  const Code& code_;
+  std::vector<int64_t> hits_;
+  absl::flat_hash_map<std::pair<int, int>, int64_t> edges_;
+  std::vector<std::pair<int, int>> history_;
+  int64_t jump_count_ = 0;
+  int loop_entry_ = -1;
+};
+
 // Returns true if the program is valid (no value is executed twice and the
 // final pc is the next instruction after |code|) and the associated accumulator
-// value.
-std::tuple<bool, int> ExecuteProgram(Code code) {
+// value. Every executed instruction, taken jump and the detected loop are
+// reported to |tracer|.
+template <typename TracerT>
+std::tuple<bool, int> RunProgram(const Code& code, TracerT& tracer) {
   int accumulator = 0;
   int pc = 0;
   absl::flat_hash_set<int> pc_visited;
   for (;;) {
     if (pc == code.size()) return {true, accumulator};
-    if (pc < 0 || pc > code.size() || pc_visited.count(pc) > 0) {
+    if (pc < 0 || pc > code.size()) return {false, accumulator};
+    if (pc_visited.count(pc) > 0) {
+      tracer.OnLoop(pc);
       return {false, accumulator};
     }
     pc_visited.insert(pc);
+    tracer.OnInstruction(pc);
     switch (code[pc].opcode) {
       case kNop:
         ++pc;
@@ -55,13 +159,28 @@ std::tuple<bool, int> ExecuteProgram(Code code) {
         ++pc;
         break;
       case kJmp:
+        tracer.OnJump(pc, pc + code[pc].operand);
         pc += code[pc].operand;
         break;
     }
   }
 }
 
+std::tuple<bool, int> ExecuteProgram(const Code& code) {
+  NullTracer tracer;
+  return RunProgram(code, tracer);
+}
+
+// Same as ExecuteProgram, but traces the run and logs a hot-spot report.
+std::tuple<bool, int> TraceProgram(const Code& code) {
+  ExecutionTracer tracer(code, FLAGS_trace_history);
+  auto result = RunProgram(code, tracer);
+  tracer.Report(FLAGS_trace_top);
+  return result;
+}
+
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -78,7 +197,8 @@ int main(int argc, char** argv) {
   // For Part 1: execute until an instruction is re-hit and return the
   // accumulator at that point.
   {
-    auto [correct, accumulator] = ExecuteProgram(code);
+    auto [correct, accumulator] =
+        FLAGS_trace ? TraceProgram(code) : ExecuteProgram(code);
     CHECK(!correct);
     LOG(INFO) << "PART 1: " << accumulator;
   }
@@ -91,6 +211,7 @@ int main(int argc, char** argv) {
     modified[i].opcode = code[i].opcode == kNop ? kJmp : kNop;
     auto [correct, accumulator] = ExecuteProgram(modified);
     if (correct) {
+      if (FLAGS_trace) TraceProgram(modified);
       LOG(INFO) << "PART 2: " << accumulator;
     }
   }
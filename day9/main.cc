@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <deque>
 #include <fstream>
 
 #include "absl/container/flat_hash_map.h"
@@ -7,55 +9,122 @@
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
 #include "absl/types/optional.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 
+DEFINE_int32(preamble, 25,
+             "Number of preceding numbers each number must be the sum of two "
+             "of.");
+
 enum Opcode { kNop, kAcc, kJmp };
 
-typedef std::vector<long> Numbers;
+// The last |size| numbers seen, kept in a ring buffer along with a count of
+// each value so that pushing a number (and evicting the oldest) is O(1) and
+// doesn't allocate once the counts map has warmed up.
+class SumWindow {
+ public:
+  explicit SumWindow(int size) : window_(size) { CHECK_GT(size, 0); }
+
+  bool Full() const { return pushed_ >= window_.size(); }
 
-bool FindSum(Numbers numbers, long number, int start, int length) {
-  absl::flat_hash_set<long> set;
-  for (int i = start; i < start + length; ++i) {
-    long new_number = numbers[i];
-    if (set.count(number - new_number) > 0) return true;
-    set.insert(new_number);
+  // Returns true if |number| is the sum of two different entries in the
+  // window.
+  bool HasPairSum(long number) const {
+    int count = std::min<int64_t>(pushed_, window_.size());
+    for (int i = 0; i < count; ++i) {
+      long other = number - window_[i];
+      auto it = counts_.find(other);
+      if (it == counts_.end()) continue;
+      // Summing a value with itself needs two copies of it in the window.
+      if (other != window_[i] || it->second > 1) return true;
+    }
+    return false;
   }
-  return false;
+
+  void Push(long number) {
+    long& slot = window_[pushed_ % window_.size()];
+    if (Full()) {
+      auto it = counts_.find(slot);
+      if (--it->second == 0) counts_.erase(it);
+    }
+    slot = number;
+    ++counts_[number];
+    ++pushed_;
+  }
+
+ private:
+  std::vector<long> window_;
+  absl::flat_hash_map<long, int> counts_;
+  int64_t pushed_ = 0;
+};
+
+// Reads the next number from |in|, one per line. Returns false at the end of
+// the input.
+bool ReadNumber(std::istream& in, long* number) {
+  std::string line;
+  if (!std::getline(in, line)) return false;
+  CHECK(absl::SimpleAtoi(line, number)) << line;
+  return true;
 }
 
-long FindBadSequence(Numbers numbers, long invalid_number) {
-  for (int i = 0; i < numbers.size(); ++i) {
-    long total = 0;
-    long smallest = INT_MAX;
-    long largest = INT_MIN;
-    for (int j = i; j < numbers.size(); ++j) {
-      long number = numbers[j];
-      smallest = std::min(smallest, number);
-      largest = std::max(largest, number);
-      total += numbers[j];
-      if (total == invalid_number) {
-        return smallest + largest;
-      }
-      if (total > invalid_number) {
-        break;
-      }
+// Finds a contiguous range of at least two numbers that sums to
+// |invalid_number| and returns the sum of its smallest and largest values.
+//
+// This is a two-pointer window over the stream: numbers are pushed on the back
+// and popped off the front while the total is too large, so only the current
+// window is held in memory. Monotonic deques of window positions track the
+// min and max as the window moves. Since the window only shrinks when the total
+// overshoots, this requires non-negative numbers.
+long FindBadSequence(std::istream& in, long invalid_number) {
+  std::deque<long> window;
+  // Positions (in the stream) of candidate minimums/maximums, with values
+  // increasing/decreasing from the front.
+  std::deque<std::pair<int64_t, long>> mins;
+  std::deque<std::pair<int64_t, long>> maxes;
+  int64_t front = 0;
+  int64_t back = 0;
+  long total = 0;
+
+  long number;
+  while (ReadNumber(in, &number)) {
+    CHECK_GE(number, 0) << "Negative numbers aren't supported.";
+    window.push_back(number);
+    total += number;
+    while (!mins.empty() && mins.back().second >= number) mins.pop_back();
+    mins.push_back({back, number});
+    while (!maxes.empty() && maxes.back().second <= number) maxes.pop_back();
+    maxes.push_back({back, number});
+    ++back;
+
+    while (total > invalid_number) {
+      total -= window.front();
+      window.pop_front();
+      if (mins.front().first == front) mins.pop_front();
+      if (maxes.front().first == front) maxes.pop_front();
+      ++front;
+    }
+    if (total == invalid_number && window.size() >= 2) {
+      return mins.front().second + maxes.front().second;
     }
   }
-  CHECK(false);
+  CHECK(false) << "No range sums to " << invalid_number;
   return -1;
 }
 
-long FirstInvalid(Numbers numbers, int preamble) {
-  for (int i = preamble; i < numbers.size(); ++i) {
-    long number = numbers[i];
-    if (!FindSum(numbers, number, i - preamble, preamble)) {
+long FirstInvalid(std::istream& in, int preamble) {
+  SumWindow window(preamble);
+  long number;
+  while (ReadNumber(in, &number)) {
+    if (window.Full() && !window.HasPairSum(number)) {
       return number;
     }
+    window.Push(number);
   }
   CHECK(false);
 }
 
 int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = 1;
@@ -63,16 +132,12 @@ int main(int argc, char** argv) {
   std::ifstream file(argv[1]);
   CHECK(file);
 
-  Numbers numbers;
-  std::string line;
-  while (std::getline(file, line)) {
-    long number;
-    CHECK(absl::SimpleAtoi(line, &number));
-    numbers.push_back(number);
-  }
-
-  long first_invalid = FirstInvalid(numbers, 25);
+  // Both parts stream the input, so the full sequence is never held in memory.
+  long first_invalid = FirstInvalid(file, FLAGS_preamble);
   LOG(INFO) << "PART 1: " << first_invalid;
-  LOG(INFO) << "PART 2: " << FindBadSequence(numbers, first_invalid);
+
+  file.clear();
+  file.seekg(0);
+  LOG(INFO) << "PART 2: " << FindBadSequence(file, first_invalid);
   return 0;
 }